@@ -0,0 +1,82 @@
+#include "cilisp.h"
+#include <stddef.h>
+
+/*
+ * Bump-pointer arena for the AST and symbol tables of the top-level
+ * expression being parsed and evaluated, one per CILISP_CONTEXT. Nothing
+ * allocated from it is freed on its own: arenaReset drops all of it at
+ * once after the expression's value is printed. Blocks are kept and reused
+ * for the next expression, so a session stops calling malloc once they're
+ * big enough for its largest expression.
+ */
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define ARENA_ALIGN _Alignof(max_align_t)
+
+typedef struct arena_block {
+    struct arena_block *next;
+    size_t size; // bytes in data
+    size_t used;
+    _Alignas(max_align_t) unsigned char data[];
+} ARENA_BLOCK;
+
+// size zeroed bytes, like calloc
+void *arenaAlloc(ARENA *arena, size_t size)
+{
+    size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+    while (arena->current == NULL || arena->current->size - arena->current->used < size) {
+        if (arena->current != NULL && arena->current->next != NULL) {
+            // Reuse a block from an earlier expression
+            arena->current = arena->current->next;
+            arena->current->used = 0;
+            continue;
+        }
+
+        size_t blockSize = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        ARENA_BLOCK *block = malloc(sizeof(ARENA_BLOCK) + blockSize);
+        if (block == NULL) {
+            yyerror("Memory allocation failed!");
+        }
+        block->next = NULL;
+        block->size = blockSize;
+        block->used = 0;
+
+        if (arena->current == NULL) {
+            arena->first = block;
+        }
+        else {
+            arena->current->next = block;
+        }
+        arena->current = block;
+    }
+
+    void *ptr = arena->current->data + arena->current->used;
+    arena->current->used += size;
+
+    return memset(ptr, 0, size);
+}
+
+// Frees everything allocated since the last reset
+void arenaReset(ARENA *arena)
+{
+    arena->current = arena->first;
+    if (arena->current != NULL) {
+        arena->current->used = 0;
+    }
+}
+
+// Gives the blocks back to malloc
+void arenaFree(ARENA *arena)
+{
+    ARENA_BLOCK *block = arena->first;
+
+    while (block != NULL) {
+        ARENA_BLOCK *next = block->next;
+        free(block);
+        block = next;
+    }
+
+    arena->first = NULL;
+    arena->current = NULL;
+}
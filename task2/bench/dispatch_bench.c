@@ -0,0 +1,124 @@
+/*
+ * Benchmark for the cost of dispatching a builtin call.
+ *
+ * For each builtin, builds ((let (x 1.5)) (f (f (f x 1.0) 1.0) ...)), a
+ * chain of CHAIN_LENGTH calls that constant folding can't touch, and times
+ * it through the tree walker and the bytecode VM against calling the
+ * kernel directly in a loop. The difference is what each evaluator spends
+ * getting to the kernel.
+ *
+ * From task2/ (builtins.c is generated by the awk step of run):
+ *     awk -f genbuiltins.awk builtins.txt
+ *     gcc -O2 -I. bench/dispatch_bench.c -o dispatch_bench -lm && ./dispatch_bench
+ * Add -DNO_COMPUTED_GOTO to time the VM's switch dispatch instead.
+ */
+#include <time.h>
+#include "cilisp.c"
+#include "builtins.c"
+#include "arena.c"
+#include "reduce.c"
+#include "vm.c"
+
+#define CHAIN_LENGTH 1000
+#define TOTAL_CALLS 20000000L
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Keeps results alive so the timed calls aren't optimized away
+static volatile double sink;
+
+// The chain of calls to func, resolved and typed like a parsed expression
+static NODE_INDEX buildChain(CILISP_CONTEXT *ctx, FUNC_TYPE func)
+{
+    int arity = builtins[func].minOps;
+    char *x = internSymbol(ctx, "x");
+    NODE_INDEX chain = createSymbolNode(ctx, x);
+
+    for (int i = 0; i < CHAIN_LENGTH; i++) {
+        int list = startExpressionList(ctx);
+        addExpressionToList(ctx, chain, list);
+        for (int j = 1; j < arity; j++) {
+            addExpressionToList(ctx, createNumberNode(ctx, DOUBLE_RET_VAL(1.0)), list);
+        }
+        chain = createFunctionNode(ctx, func, list);
+    }
+
+    NODE_INDEX root = createScopeNode(ctx, createSymbolTableNode(ctx, x, createNumberNode(ctx, DOUBLE_RET_VAL(1.5))), chain);
+    resolveSymbols(ctx, root);
+    inferTypes(ctx, root);
+
+    return root;
+}
+
+// ns per call of the chain's builtin, evaluated the tree walker's way
+static double timeTreeWalk(CILISP_CONTEXT *ctx, NODE_INDEX root)
+{
+    long reps = TOTAL_CALLS / CHAIN_LENGTH;
+    double start = now();
+
+    for (long r = 0; r < reps; r++) {
+        sink = toDouble(callNodeTypeEval(ctx, root));
+    }
+
+    return (now() - start) * 1e9 / TOTAL_CALLS;
+}
+
+static double timeVm(CILISP_CONTEXT *ctx, NODE_INDEX root)
+{
+    long reps = TOTAL_CALLS / CHAIN_LENGTH;
+    CHUNK *chunk = compileChunk(ctx, root);
+    double start = now();
+
+    for (long r = 0; r < reps; r++) {
+        sink = toDouble(runChunk(ctx, chunk));
+    }
+
+    double elapsed = now() - start;
+    freeChunk(chunk);
+
+    return elapsed * 1e9 / TOTAL_CALLS;
+}
+
+// The same calls made straight to the kernel, with nothing to dispatch
+static double timeDirect(CILISP_CONTEXT *ctx, FUNC_TYPE func)
+{
+    int arity = builtins[func].minOps;
+    BUILTIN_KERNEL kernel = builtins[func].applyDouble ? builtins[func].applyDouble : builtins[func].apply;
+    RET_VAL ops[2] = {DOUBLE_RET_VAL(1.5), DOUBLE_RET_VAL(1.0)};
+    double start = now();
+
+    for (long i = 0; i < TOTAL_CALLS; i++) {
+        ops[0] = kernel(ctx, ops, arity);
+    }
+
+    sink = toDouble(ops[0]);
+    return (now() - start) * 1e9 / TOTAL_CALLS;
+}
+
+int main(void)
+{
+    CILISP_CONTEXT *ctx = createContext(stdout);
+
+    printf("%-10s %8s %8s %8s %10s %10s   (ns per call)\n",
+           "func", "direct", "tree", "vm", "tree cost", "vm cost");
+
+    for (FUNC_TYPE func = 0; func < FUNC_COUNT; func++) {
+        NODE_INDEX root = buildChain(ctx, func);
+
+        double direct = timeDirect(ctx, func);
+        double treeWalk = timeTreeWalk(ctx, root);
+        double vm = timeVm(ctx, root);
+        printf("%-10s %8.2f %8.2f %8.2f %10.2f %10.2f\n",
+               builtins[func].name, direct, treeWalk, vm, treeWalk - direct, vm - direct);
+
+        clearAst(ctx);
+    }
+
+    freeContext(ctx);
+    return 0;
+}
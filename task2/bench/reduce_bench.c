@@ -0,0 +1,116 @@
+/*
+ * Benchmark for the variadic builtin reductions in reduce.c.
+ *
+ * Times each kernel set this CPU supports (scalar, SSE2, AVX2) on
+ * 10^3 to 10^6 operands and checks that they agree with the scalar loop.
+ *
+ * From task2/:
+ *     gcc -O2 -I. bench/reduce_bench.c -o reduce_bench -lm && ./reduce_bench
+ */
+#include <time.h>
+#include "reduce.c"
+
+#define TOTAL_OPERANDS 200000000L
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Keeps results alive so the timed calls aren't optimized away
+static volatile double sink;
+
+static double timeKernel(const REDUCE_KERNELS *kernels, int which, RET_VAL *ops, int count)
+{
+    long reps = TOTAL_OPERANDS / count;
+    double start = now();
+
+    for (long r = 0; r < reps; r++) {
+        switch (which) {
+            case 0: sink = kernels->sum(ops, count); break;
+            case 1: sink = kernels->product(ops, count); break;
+            case 2: sink = kernels->sumSquares(ops, count); break;
+            case 3: sink = kernels->maxIndex(ops, count); break;
+            case 4: sink = kernels->minIndex(ops, count); break;
+        }
+    }
+
+    return (now() - start) * 1e9 / ((double) reps * count);
+}
+
+static bool agrees(const REDUCE_KERNELS *kernels, int which, RET_VAL *ops, int count)
+{
+    double value, expected;
+
+    switch (which) {
+        case 0:
+            value = kernels->sum(ops, count);
+            expected = scalarKernels.sum(ops, count);
+            return fabs(value - expected) <= 1e-9 * fabs(expected);
+        case 1:
+            value = kernels->product(ops, count);
+            expected = scalarKernels.product(ops, count);
+            return fabs(value - expected) <= 1e-9 * fabs(expected);
+        case 2:
+            value = kernels->sumSquares(ops, count);
+            expected = scalarKernels.sumSquares(ops, count);
+            return fabs(value - expected) <= 1e-9 * fabs(expected);
+        case 3:
+            return kernels->maxIndex(ops, count) == scalarKernels.maxIndex(ops, count);
+        default:
+            return kernels->minIndex(ops, count) == scalarKernels.minIndex(ops, count);
+    }
+}
+
+int main(void)
+{
+    const char *names[] = {"add", "mult", "hypot", "max", "min"};
+    const REDUCE_KERNELS *sets[3] = {&scalarKernels, NULL, NULL};
+    const char *setNames[3] = {"scalar", "sse2", "avx2"};
+
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    sets[1] = &sse2Kernels;
+    if (__builtin_cpu_supports("avx2")) {
+        sets[2] = &avx2Kernels;
+    }
+#endif
+
+    srand(232);
+    printf("%-6s %8s %10s %10s %10s   (ns per operand, speedup over scalar)\n",
+           "func", "operands", setNames[0], setNames[1], setNames[2]);
+
+    for (int count = 1000; count <= 1000000; count *= 10) {
+        RET_VAL *ops = malloc(sizeof(RET_VAL) * count);
+
+        // Values near 1 keep long products finite
+        for (int i = 0; i < count; i++) {
+            ops[i] = DOUBLE_RET_VAL(1.0 + (rand() % 2001 - 1000) / 1e7);
+        }
+
+        for (int which = 0; which < 5; which++) {
+            double scalar = timeKernel(sets[0], which, ops, count);
+            printf("%-6s %8d %10.3f", names[which], count, scalar);
+
+            for (int s = 1; s < 3; s++) {
+                if (sets[s] == NULL) {
+                    printf(" %10s", "-");
+                    continue;
+                }
+                if (!agrees(sets[s], which, ops, count)) {
+                    printf("\n%s %s disagrees with the scalar loop!\n", setNames[s], names[which]);
+                    return 1;
+                }
+                double t = timeKernel(sets[s], which, ops, count);
+                printf(" %6.3f %4.1fx", t, scalar / t);
+            }
+            printf("\n");
+        }
+
+        free(ops);
+    }
+
+    return 0;
+}
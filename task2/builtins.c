@@ -0,0 +1,102 @@
+// Generated by genbuiltins.awk from builtins.txt. Do not edit.
+#include "cilisp.h"
+
+#define BUILTIN_HASH_SEED 41
+#define BUILTIN_HASH_MOD 1048573
+#define BUILTIN_HASH_SIZE 26
+
+RET_VAL evalNeg(CILISP_CONTEXT *ctx, RET_VAL *ops, int count);
+RET_VAL evalAbs(CILISP_CONTEXT *ctx, RET_VAL *ops, int count);
+RET_VAL evalAdd(CILISP_CONTEXT *ctx, RET_VAL *ops, int count);
+RET_VAL evalAddInt(CILISP_CONTEXT *ctx, RET_VAL *ops, int count);
+RET_VAL evalAddDouble(CILISP_CONTEXT *ctx, RET_VAL *ops, int count);
+RET_VAL evalSub(CILISP_CONTEXT *ctx, RET_VAL *ops, int count);
+RET_VAL evalSubInt(CILISP_CONTEXT *ctx, RET_VAL *ops, int count);
+RET_VAL evalSubDouble(CILISP_CONTEXT *ctx, RET_VAL *ops, int count);
+RET_VAL evalMult(CILISP_CONTEXT *ctx, RET_VAL *ops, int count);
+RET_VAL evalMultInt(CILISP_CONTEXT *ctx, RET_VAL *ops, int count);
+RET_VAL evalMultDouble(CILISP_CONTEXT *ctx, RET_VAL *ops, int count);
+RET_VAL evalDiv(CILISP_CONTEXT *ctx, RET_VAL *ops, int count);
+RET_VAL evalDivInt(CILISP_CONTEXT *ctx, RET_VAL *ops, int count);
+RET_VAL evalDivDouble(CILISP_CONTEXT *ctx, RET_VAL *ops, int count);
+RET_VAL evalRem(CILISP_CONTEXT *ctx, RET_VAL *ops, int count);
+RET_VAL evalExp(CILISP_CONTEXT *ctx, RET_VAL *ops, int count);
+RET_VAL evalExp2(CILISP_CONTEXT *ctx, RET_VAL *ops, int count);
+RET_VAL evalPow(CILISP_CONTEXT *ctx, RET_VAL *ops, int count);
+RET_VAL evalLog(CILISP_CONTEXT *ctx, RET_VAL *ops, int count);
+RET_VAL evalSqrt(CILISP_CONTEXT *ctx, RET_VAL *ops, int count);
+RET_VAL evalCbrt(CILISP_CONTEXT *ctx, RET_VAL *ops, int count);
+RET_VAL evalHypot(CILISP_CONTEXT *ctx, RET_VAL *ops, int count);
+RET_VAL evalHypotDouble(CILISP_CONTEXT *ctx, RET_VAL *ops, int count);
+RET_VAL evalMax(CILISP_CONTEXT *ctx, RET_VAL *ops, int count);
+RET_VAL evalMaxInt(CILISP_CONTEXT *ctx, RET_VAL *ops, int count);
+RET_VAL evalMaxDouble(CILISP_CONTEXT *ctx, RET_VAL *ops, int count);
+RET_VAL evalMin(CILISP_CONTEXT *ctx, RET_VAL *ops, int count);
+RET_VAL evalMinInt(CILISP_CONTEXT *ctx, RET_VAL *ops, int count);
+RET_VAL evalMinDouble(CILISP_CONTEXT *ctx, RET_VAL *ops, int count);
+
+const BUILTIN builtins[FUNC_COUNT] = {
+    [NEG_FUNC] = {"neg", evalNeg, NULL, NULL, 1, 1, {DOUBLE_TYPE, .dval = NAN}, PROMOTED_RESULT},
+    [ABS_FUNC] = {"abs", evalAbs, NULL, NULL, 1, 1, {DOUBLE_TYPE, .dval = NAN}, PROMOTED_RESULT},
+    [ADD_FUNC] = {"add", evalAdd, evalAddInt, evalAddDouble, 1, -1, {INT_TYPE, .ival = 0}, PROMOTED_RESULT},
+    [SUB_FUNC] = {"sub", evalSub, evalSubInt, evalSubDouble, 2, 2, {DOUBLE_TYPE, .dval = NAN}, PROMOTED_RESULT},
+    [MULT_FUNC] = {"mult", evalMult, evalMultInt, evalMultDouble, 1, -1, {INT_TYPE, .ival = 1}, PROMOTED_RESULT},
+    [DIV_FUNC] = {"div", evalDiv, evalDivInt, evalDivDouble, 2, 2, {DOUBLE_TYPE, .dval = NAN}, PROMOTED_RESULT},
+    [REM_FUNC] = {"remainder", evalRem, NULL, NULL, 2, 2, {DOUBLE_TYPE, .dval = NAN}, PROMOTED_RESULT},
+    [EXP_FUNC] = {"exp", evalExp, NULL, NULL, 1, 1, {DOUBLE_TYPE, .dval = NAN}, DOUBLE_RESULT},
+    [EXP2_FUNC] = {"exp2", evalExp2, NULL, NULL, 1, 1, {DOUBLE_TYPE, .dval = NAN}, PROMOTED_RESULT},
+    [POW_FUNC] = {"pow", evalPow, NULL, NULL, 2, 2, {DOUBLE_TYPE, .dval = NAN}, PROMOTED_RESULT},
+    [LOG_FUNC] = {"log", evalLog, NULL, NULL, 1, 1, {DOUBLE_TYPE, .dval = NAN}, DOUBLE_RESULT},
+    [SQRT_FUNC] = {"sqrt", evalSqrt, NULL, NULL, 1, 1, {DOUBLE_TYPE, .dval = NAN}, DOUBLE_RESULT},
+    [CBRT_FUNC] = {"cbrt", evalCbrt, NULL, NULL, 1, 1, {DOUBLE_TYPE, .dval = NAN}, DOUBLE_RESULT},
+    [HYPOT_FUNC] = {"hypot", evalHypot, NULL, evalHypotDouble, 1, -1, {DOUBLE_TYPE, .dval = 0.0}, DOUBLE_RESULT},
+    [MAX_FUNC] = {"max", evalMax, evalMaxInt, evalMaxDouble, 1, -1, {DOUBLE_TYPE, .dval = NAN}, OPERAND_RESULT},
+    [MIN_FUNC] = {"min", evalMin, evalMinInt, evalMinDouble, 1, -1, {DOUBLE_TYPE, .dval = NAN}, OPERAND_RESULT},
+};
+
+// FUNC_TYPE of the builtin hashing to each slot, -1 for none
+static const signed char builtinSlots[BUILTIN_HASH_SIZE] = {
+    -1,
+    EXP2_FUNC,
+    MIN_FUNC,
+    EXP_FUNC,
+    SUB_FUNC,
+    -1,
+    -1,
+    CBRT_FUNC,
+    MAX_FUNC,
+    -1,
+    -1,
+    DIV_FUNC,
+    REM_FUNC,
+    -1,
+    LOG_FUNC,
+    -1,
+    NEG_FUNC,
+    MULT_FUNC,
+    POW_FUNC,
+    ADD_FUNC,
+    ABS_FUNC,
+    HYPOT_FUNC,
+    -1,
+    SQRT_FUNC,
+    -1,
+    -1,
+};
+
+// The builtin called name, CUSTOM_FUNC if there's none
+FUNC_TYPE resolveFunc(const char *name)
+{
+    unsigned long h = BUILTIN_HASH_SEED;
+
+    for (const unsigned char *c = (const unsigned char *) name; *c != '\0'; c++) {
+        h = (h * 33 + *c) % BUILTIN_HASH_MOD;
+    }
+
+    int func = builtinSlots[h % BUILTIN_HASH_SIZE];
+    if (func < 0 || strcmp(builtins[func].name, name) != 0) {
+        return CUSTOM_FUNC;
+    }
+
+    return func;
+}
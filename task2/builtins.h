@@ -0,0 +1,27 @@
+// Generated by genbuiltins.awk from builtins.txt. Do not edit.
+#ifndef __builtins_h_
+#define __builtins_h_
+
+typedef enum func_type {
+    NEG_FUNC,
+    ABS_FUNC,
+    ADD_FUNC,
+    SUB_FUNC,
+    MULT_FUNC,
+    DIV_FUNC,
+    REM_FUNC,
+    EXP_FUNC,
+    EXP2_FUNC,
+    POW_FUNC,
+    LOG_FUNC,
+    SQRT_FUNC,
+    CBRT_FUNC,
+    HYPOT_FUNC,
+    MAX_FUNC,
+    MIN_FUNC,
+    CUSTOM_FUNC
+} FUNC_TYPE;
+
+#define FUNC_COUNT 16 // builtins, not counting CUSTOM_FUNC
+
+#endif
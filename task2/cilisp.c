@@ -2,11 +2,18 @@
 
 #define RED             "\033[31m"
 #define RESET_COLOR     "\033[0m"
-#define FUNC_COUNT 17
 
-RET_VAL evalScopeNode(AST_NODE *node);
-RET_VAL evalSymNode(AST_NODE *node);
-RET_VAL callNodeTypeEval(AST_NODE *node);
+#define INITIAL_ARRAY_CAP 16
+
+RET_VAL callNodeTypeEval(CILISP_CONTEXT *ctx, NODE_INDEX index);
+NODE_INDEX foldConstants(CILISP_CONTEXT *ctx, NODE_INDEX index);
+RET_VAL evalAddInt(CILISP_CONTEXT *ctx, RET_VAL *ops, int count);
+RET_VAL evalAddDouble(CILISP_CONTEXT *ctx, RET_VAL *ops, int count);
+RET_VAL evalSubInt(CILISP_CONTEXT *ctx, RET_VAL *ops, int count);
+RET_VAL evalMultInt(CILISP_CONTEXT *ctx, RET_VAL *ops, int count);
+RET_VAL evalMultDouble(CILISP_CONTEXT *ctx, RET_VAL *ops, int count);
+RET_VAL evalDivInt(CILISP_CONTEXT *ctx, RET_VAL *ops, int count);
+RET_VAL evalHypotDouble(CILISP_CONTEXT *ctx, RET_VAL *ops, int count);
 
 // yyerror:
 // Something went so wrong that the whole program should crash.
@@ -15,6 +22,9 @@ RET_VAL callNodeTypeEval(AST_NODE *node);
 // This is basically printf, but red, with "\nERROR: " prepended, "\n" appended,
 // and an "exit(1);" at the end to crash the program.
 // It's called "yyerror" instead of "error" so the parser will use it for errors too.
+// Inside a library call, it hands the message to the call to return with instead.
+_Thread_local ERROR_TRAP *errorTrap;
+
 void yyerror(char *format, ...)
 {
     char buffer[256];
@@ -22,13 +32,25 @@ void yyerror(char *format, ...)
     va_start (args, format);
     vsnprintf (buffer, 255, format, args);
 
-    printf(RED "\nERROR: %s\nExiting...\n" RESET_COLOR, buffer);
+    if (errorTrap != NULL) {
+        va_end (args);
+        strcpy(errorTrap->message, buffer);
+        longjmp(errorTrap->jump, 1);
+    }
+
+    printError(stdout, buffer);
     fflush(stdout);
 
     va_end (args);
     exit(1);
 }
 
+// What yyerror prints, for whoever reports an error without exiting
+void printError(FILE *out, char *message)
+{
+    fprintf(out, RED "\nERROR: %s\nExiting...\n" RESET_COLOR, message);
+}
+
 // warning:
 // Something went mildly wrong (on the user-input level, probably)
 // Let the user know what happened and what you're doing about it.
@@ -38,179 +60,352 @@ void yyerror(char *format, ...)
 //      too few arguments, let them know and return NAN
 //      invalid arguments, let them know and return NAN
 //      many more uses to be added as we progress...
-// This is basically printf, but red, and with "\nWARNING: " prepended and "\n" appended.
-void warning(char *format, ...)
+// This is basically printf to ctx->out, but red, and with "\nWARNING: " prepended and "\n" appended.
+void warning(CILISP_CONTEXT *ctx, char *format, ...)
 {
     char buffer[256];
     va_list args;
     va_start (args, format);
     vsnprintf (buffer, 255, format, args);
 
-    printf(RED "WARNING: %s\n" RESET_COLOR, buffer);
-    fflush(stdout);
+    fprintf(ctx->out, RED "WARNING: %s\n" RESET_COLOR, buffer);
+    fflush(ctx->out);
 
     va_end (args);
 }
 
-FUNC_TYPE resolveFunc(char *funcName)
-{
-    // Array of string values for function names.
-    // Must be in sync with members of the FUNC_TYPE enum in order for resolveFunc to work.
-    // For example, funcNames[NEG_FUNC] should be "neg"
-    char *funcNames[] = {
-            "neg",
-            "abs",
-            "add",
-            "sub",
-            "mult",
-            "div",
-            "remainder",
-            "exp",
-            "exp2", // HUH?
-            "pow",
-            "log",
-            "sqrt",
-            "cbrt",
-            "hypot",
-            "max",
-            "min",
-            "custom", // NOTE: No idea if this is supposed to be here
-                      // if it isn't CUSTOM_FUNC is empty string
-            ""
-    };
-    int i = 0;
-    while (funcNames[i][0] != '\0')
-    {
-        if (strcmp(funcNames[i], funcName) == 0)
-        {
-            return i;
-        }
-        i++;
+// The parser's errors: fatal like any yyerror, unless ctx->keepRunning,
+// which keeps the first in ctx->error for whoever is driving the parser
+void parseError(CILISP_CONTEXT *ctx, char *message)
+{
+    if (!ctx->keepRunning) {
+        yyerror("%s", message);
+    }
+
+    if (ctx->error == NULL) {
+        ctx->error = message;
     }
-    return CUSTOM_FUNC;
 }
 
+// Grows a dynamic array so it can hold one more element than count
+void *growArray(void *array, int count, int *cap, size_t elemSize)
+{
+    if (count < *cap) {
+        return array;
+    }
 
-AST_NODE *createAstNode(AST_NODE_TYPE type) {
-    AST_NODE *node;
-    size_t nodeSize;
+    // *cap only changes once the memory is there: a library call that runs
+    // out of memory returns with the array as it was (see ERROR_TRAP)
+    int newCap = *cap;
+    while (count >= newCap) {
+        newCap = newCap ? 2 * newCap : INITIAL_ARRAY_CAP;
+    }
+    if ((array = realloc(array, newCap * elemSize)) == NULL) {
+        yyerror("Memory allocation failed!");
+    }
+    *cap = newCap;
 
-    nodeSize = sizeof(AST_NODE);
-    if ((node = calloc(nodeSize, 1)) == NULL)
-    {
+    return array;
+}
+
+// A context with the default options, writing to out
+CILISP_CONTEXT *createContext(FILE *out)
+{
+    CILISP_CONTEXT *ctx;
+
+    if ((ctx = calloc(1, sizeof(CILISP_CONTEXT))) == NULL) {
         yyerror("Memory allocation failed!");
-        exit(1);
     }
 
-    node->type = type;
+    ctx->maxDepth = DEFAULT_MAX_DEPTH;
+    ctx->out = out;
+    ctx->readTarget = stdin;
 
-    return node;
+    return ctx;
+}
+
+// Frees ctx and everything it allocated. Its streams and scanner belong
+// to whoever set them and are left alone.
+void freeContext(CILISP_CONTEXT *ctx)
+{
+    if (!ctx) {
+        return;
+    }
 
+    free(ctx->tree.nodes);
+    free(ctx->tree.operands);
+    free(ctx->tree.symbols);
+    free(ctx->tree.scopes);
+    arenaFree(&ctx->arena);
+    free(ctx->pendingOperands);
+
+    for (size_t i = 0; i < ctx->internCap; i++) {
+        free(ctx->internTable[i]);
+    }
+    free(ctx->internTable);
+
+    free(ctx->scopeChain);
+    free(ctx->resolveStack);
+    free(ctx->letValues);
+    free(ctx->frameBase);
+    free(ctx->evalFrames);
+    free(ctx->evalValues);
+    free(ctx->compileFrames);
+    free(ctx->freeVariableSlots);
+    free(ctx->parseStack);
+    free(ctx);
 }
 
+// Index of a new node in ctx->tree.nodes. Adding a node can move ctx->tree.nodes,
+// so don't hold on to node pointers across calls.
+NODE_INDEX createAstNode(CILISP_CONTEXT *ctx, AST_NODE_TYPE type) {
+    if (ctx->tree.nodeCount == 0) {
+        ctx->tree.nodeCount = 1; // skip NO_NODE
+    }
 
-AST_NODE *createNumberNode(double value, NUM_TYPE type)
-{
-    AST_NODE *node;
-    size_t nodeSize;
+    ctx->tree.nodes = growArray(ctx->tree.nodes, ctx->tree.nodeCount, &ctx->tree.nodeCap, sizeof(AST_NODE));
+    ctx->tree.nodes[ctx->tree.nodeCount] = (AST_NODE) {.type = type, .numType = UNKNOWN_TYPE, .kernelType = UNKNOWN_TYPE};
 
-    nodeSize = sizeof(AST_NODE);
-    if ((node = calloc(nodeSize, 1)) == NULL)
-    {
-        yyerror("Memory allocation failed!");
-        exit(1);
+    return ctx->tree.nodeCount++;
+}
+
+
+// Stores value's type and lane in a number node
+static void setNumber(AST_NODE *node, RET_VAL value)
+{
+    node->subtype = value.type;
+    if (value.type == INT_TYPE) {
+        node->data.integer = value.ival;
     }
+    else {
+        node->data.number = value.dval;
+    }
+}
+
+NODE_INDEX createNumberNode(CILISP_CONTEXT *ctx, RET_VAL value)
+{
+    NODE_INDEX index = createAstNode(ctx, NUM_NODE_TYPE);
 
     // Populate node atributes
-    node->type = NUM_NODE_TYPE;
-    node->data.number.type = type;
-    node->data.number.value = value;
+    setNumber(&ctx->tree.nodes[index], value);
 
-    return node;
+    return index;
 }
 
-// Sets each member of childLists' parent
-void setParents(AST_NODE *parent, AST_NODE *childList) {
-    AST_NODE *cur = childList;
-    while (cur != NULL) {
-        cur->parent = parent;
-        cur = cur->next;
+/*
+ * The arity warnings, worded as each kernel worded its own before
+ * checkArity took them over, so scripts' output doesn't change. NULL where
+ * the builtin can't get that count wrong.
+ */
+static const struct {
+    const char *noOperands;
+    const char *oneOperand;
+    const char *extraOperands;
+} arityWarnings[FUNC_COUNT] = {
+    [NEG_FUNC] = {"no operands! nan returned", NULL, "extra (ignored) operands"},
+    [ABS_FUNC] = {"no operands! nan returned", NULL, "extra (ignored) operands"},
+    [ADD_FUNC] = {"no operands! nan returned", NULL, NULL},
+    [SUB_FUNC] = {"no operands! nan returned", "only one operands! nan returned", "extra (ignored) operands"},
+    [MULT_FUNC] = {"no operands! nan returned", NULL, NULL},
+    [DIV_FUNC] = {"no operands! nan returned", "only one operand! nan returned", "extra (ignored) operands"},
+    [REM_FUNC] = {"no operands! nan returned", "only one operand! nan returned", "extra (ignored) operands"},
+    [EXP_FUNC] = {"no operands! nan returned", NULL, "extra (ignored) operands"},
+    [EXP2_FUNC] = {"no operands! nan returned", NULL, "extra (ignored) operands"},
+    [POW_FUNC] = {"no operands! nan returned", "only one operands! nan returned", "extra (ignored) operands"},
+    [LOG_FUNC] = {"no operands! nan returned", NULL, "extra (ignored) operands!"},
+    [SQRT_FUNC] = {"no operands! nan returned", NULL, "extra (ignored) operands!"},
+    [CBRT_FUNC] = {"no operands! nan returned", NULL, "extra (ignored) operands!"},
+    [HYPOT_FUNC] = {"no operands! 0 returned", NULL, NULL},
+    [MAX_FUNC] = {"no operands! nan returned", NULL, NULL},
+    [MIN_FUNC] = {"no operands! nan returned", NULL, NULL},
+};
+
+/*
+ * Checks a call's operand count against its builtin's, once, as it's
+ * parsed: too few and the call is replaced by the builtin's fallback
+ * value, too many and the extras are dropped. Either way there's a
+ * warning. The kernels can then take their operands as given.
+ * Returns the number of operands to keep, -1 for the fallback.
+ */
+static int checkArity(CILISP_CONTEXT *ctx, FUNC_TYPE func, int count)
+{
+    const BUILTIN *builtin = &builtins[func];
+
+    if (count < builtin->minOps) {
+        fprintf(ctx->out, "WARNING: %s called with %s\n", builtin->name,
+                count == 0 ? arityWarnings[func].noOperands : arityWarnings[func].oneOperand);
+        return -1;
+    }
+    if (builtin->maxOps != -1 && count > builtin->maxOps) {
+        fprintf(ctx->out, "WARNING: %s called with %s\n", builtin->name, arityWarnings[func].extraOperands);
+        return builtin->maxOps;
     }
+
+    return count;
 }
 
-AST_NODE *createFunctionNode(FUNC_TYPE func, AST_NODE *opList)
+// list is where the call's operands start in ctx->pendingOperands
+NODE_INDEX createFunctionNode(CILISP_CONTEXT *ctx, FUNC_TYPE func, int list)
 {
-    AST_NODE *node;
-    size_t nodeSize;
+    int count = checkArity(ctx, func, ctx->pendingCount - list);
 
-    nodeSize = sizeof(AST_NODE);
-    if ((node = calloc(nodeSize, 1)) == NULL)
-    {
-        yyerror("Memory allocation failed!");
-        exit(1);
+    if (count < 0) {
+        ctx->pendingCount = list;
+        return createNumberNode(ctx, builtins[func].fallback);
     }
 
-    // Populate the allocated AST_NODE *node's data
-    node->type = FUNC_NODE_TYPE;
-    node->data.function.func = func;
-    node->data.function.opList = opList;
+    NODE_INDEX index = createAstNode(ctx, FUNC_NODE_TYPE);
+
+    // Move the operands to the end of ctx->tree.operands
+    if (count > 0) {
+        ctx->tree.operands = growArray(ctx->tree.operands, ctx->tree.operandCount + count, &ctx->tree.operandCap, sizeof(NODE_INDEX));
+        memcpy(ctx->tree.operands + ctx->tree.operandCount, ctx->pendingOperands + list, sizeof(NODE_INDEX) * count);
+    }
+    ctx->pendingCount = list;
 
-    setParents(node, opList);
+    // Populate the node's data
+    AST_NODE *node = &ctx->tree.nodes[index];
+    node->subtype = func;
+    node->data.function.first = ctx->tree.operandCount;
+    node->data.function.count = count;
+    ctx->tree.operandCount += count;
 
-    return node;
+    for (int i = 0; i < count; i++) {
+        ctx->tree.nodes[ctx->tree.operands[node->data.function.first + i]].parent = index;
+    }
+
+    return foldConstants(ctx, index);
 }
 
-AST_NODE *createScopeNode(SYMBOL_TABLE_NODE *symTable, AST_NODE *s_expr)
+NODE_INDEX createScopeNode(CILISP_CONTEXT *ctx, SYMBOL_TABLE_NODE *symTable, NODE_INDEX s_expr)
 {
-    AST_NODE *node;
-    node = createAstNode(SCOPE_NODE_TYPE);
+    NODE_INDEX index = createAstNode(ctx, SCOPE_NODE_TYPE);
+
+    ctx->tree.scopes = growArray(ctx->tree.scopes, ctx->tree.scopeCount, &ctx->tree.scopeCap, sizeof(AST_SCOPE));
+    ctx->tree.scopes[ctx->tree.scopeCount] = (AST_SCOPE) {symTable, 0, 0};
 
     // Set parent child relation between node and s_expr
-    node->data.scope.child = s_expr;
+    ctx->tree.nodes[index].data.scope.child = s_expr;
+    ctx->tree.nodes[index].data.scope.index = ctx->tree.scopeCount++;
 
-    // NOTE: Directions state do each of these pg 31:
-    s_expr->parent = node;
-    s_expr->symbolTable = symTable;
+    // The scope owns both its body and its let values
+    ctx->tree.nodes[s_expr].parent = index;
     SYMBOL_TABLE_NODE *cur = symTable;
     while (cur != NULL) {
-        cur->value->parent = s_expr; 
+        ctx->tree.nodes[cur->value].parent = index;
         cur = cur->next;
     }
 
-    return node;
+    return index;
 }
 
-AST_NODE *createSymbolNode(char *name) {
-    AST_NODE *node = createAstNode(SYM_NODE_TYPE);
+// Empties ctx->tree and the arena, once the expression has been evaluated
+void clearAst(CILISP_CONTEXT *ctx)
+{
+    ctx->tree.nodeCount = 0;
+    ctx->tree.operandCount = 0;
+    ctx->tree.symbolCount = 0;
+    ctx->tree.scopeCount = 0;
+    ctx->pendingCount = 0;
+    arenaReset(&ctx->arena);
+}
 
-    node->data.symbol.id = name;
+// Intern table: one copy of every identifier seen, so symbols can be
+// compared by pointer. Open addressing, kept at most half full.
 
-    return node;
+static size_t hashName(const char *name) {
+    size_t hash = 14695981039346656037UL; // FNV-1a
+
+    while (*name) {
+        hash = (hash ^ (unsigned char) *name++) * 1099511628211UL;
+    }
+
+    return hash;
+}
+
+static void growInternTable(CILISP_CONTEXT *ctx) {
+    char **old = ctx->internTable;
+    size_t oldCap = ctx->internCap;
+    size_t cap = oldCap ? 2 * oldCap : 256;
+    char **table = calloc(cap, sizeof(char *));
+
+    if (table == NULL) {
+        yyerror("Memory allocation failed!");
+    }
+    ctx->internTable = table;
+    ctx->internCap = cap;
+
+    for (size_t i = 0; i < oldCap; i++) {
+        if (old[i] != NULL) {
+            size_t slot = hashName(old[i]) & (ctx->internCap - 1);
+            while (ctx->internTable[slot] != NULL) {
+                slot = (slot + 1) & (ctx->internCap - 1);
+            }
+            ctx->internTable[slot] = old[i];
+        }
+    }
+
+    free(old);
+}
+
+/*
+ * Returns the unique copy of name, making one the first time name is seen.
+ * Interned names live as long as ctx and must not be freed.
+ */
+char *internSymbol(CILISP_CONTEXT *ctx, const char *name) {
+    if (2 * (ctx->internCount + 1) > ctx->internCap) {
+        growInternTable(ctx);
+    }
+
+    size_t slot = hashName(name) & (ctx->internCap - 1);
+    while (ctx->internTable[slot] != NULL) {
+        if (strcmp(ctx->internTable[slot], name) == 0) {
+            return ctx->internTable[slot];
+        }
+        slot = (slot + 1) & (ctx->internCap - 1);
+    }
+
+    if ((ctx->internTable[slot] = strdup(name)) == NULL) {
+        yyerror("Memory allocation failed!");
+    }
+    ctx->internCount++;
+
+    return ctx->internTable[slot];
+}
+
+// name must come from internSymbol
+NODE_INDEX createSymbolNode(CILISP_CONTEXT *ctx, char *name) {
+    NODE_INDEX index = createAstNode(ctx, SYM_NODE_TYPE);
+
+    ctx->tree.symbols = growArray(ctx->tree.symbols, ctx->tree.symbolCount, &ctx->tree.symbolCap, sizeof(AST_SYMBOL));
+    ctx->tree.symbols[ctx->tree.symbolCount] = (AST_SYMBOL) {name, -1, 0, NULL};
+    ctx->tree.nodes[index].data.symbol.index = ctx->tree.symbolCount++;
+
+    return index;
 }
 
-SYMBOL_TABLE_NODE *createSymbolTableNode(char *id, AST_NODE *val) {
+// id must come from internSymbol
+SYMBOL_TABLE_NODE *createSymbolTableNode(CILISP_CONTEXT *ctx, char *id, NODE_INDEX val) {
     SYMBOL_TABLE_NODE *node;
     size_t nodeSize;
 
     nodeSize = sizeof(SYMBOL_TABLE_NODE);
-    if ((node = calloc(nodeSize, 1)) == NULL)
-    {
-        yyerror("Memory allocation failed!");
-        exit(1);
-    }
+    node = arenaAlloc(&ctx->arena, nodeSize);
 
     node->id = id;
     node->value = val;
+    node->binding = 0; // the arena's memory can be an earlier expression's
 
     return node;
 }
 
+// name must come from internSymbol, so it can be compared by pointer
 SYMBOL_TABLE_NODE *findSymbol(char* name, SYMBOL_TABLE_NODE *symList) {
     SYMBOL_TABLE_NODE *cur = symList;
 
     //printf("---------findSymbol\n");
     while (cur != NULL) {
-        if (strcmp(name, cur->id) == 0) {
+        if (name == cur->id) {
             // Symbol found
             return cur;
         }
@@ -222,7 +417,7 @@ SYMBOL_TABLE_NODE *findSymbol(char* name, SYMBOL_TABLE_NODE *symList) {
     return NULL;
 }
 
-SYMBOL_TABLE_NODE *addSymbolToList(SYMBOL_TABLE_NODE *sym, SYMBOL_TABLE_NODE *symList) {
+SYMBOL_TABLE_NODE *addSymbolToList(CILISP_CONTEXT *ctx, SYMBOL_TABLE_NODE *sym, SYMBOL_TABLE_NODE *symList) {
     // Check if symbol is defined already (in current scope)
     SYMBOL_TABLE_NODE *node = findSymbol(sym->id, symList); 
     if (node == NULL)
@@ -233,204 +428,223 @@ SYMBOL_TABLE_NODE *addSymbolToList(SYMBOL_TABLE_NODE *sym, SYMBOL_TABLE_NODE *sy
     }
     else {
         // Symbol already defined; Discard new value definition
-        printf("WARNING: multiple (ignored) definitions of %s\n", sym->id); 
+        fprintf(ctx->out, "WARNING: multiple (ignored) definitions of %s\n", sym->id); 
         node->value = sym->value; //NOTE: yacc parses right let_elem first so we have to keep the 
                                   // duplicate and get ride of first def
         return symList;
     }
 }
 
-AST_NODE *addExpressionToList(AST_NODE *newExpr, AST_NODE *exprList)
+// Where a new operand list starts in ctx->pendingOperands
+int startExpressionList(CILISP_CONTEXT *ctx)
 {
-    // Add new expression as head
-    newExpr->next = exprList;
-    return newExpr;
+    return ctx->pendingCount;
 }
 
-int getOperandCound(AST_NODE *opList, int number) {
-    int count = 0;
-    AST_NODE *cur = opList;
-
-    while (cur != NULL) {
-        cur = cur->next;
-        count++;
-    }
+// Appends newExpr to the operand list starting at list
+int addExpressionToList(CILISP_CONTEXT *ctx, NODE_INDEX newExpr, int list)
+{
+    ctx->pendingOperands = growArray(ctx->pendingOperands, ctx->pendingCount, &ctx->pendingCap, sizeof(NODE_INDEX));
+    ctx->pendingOperands[ctx->pendingCount++] = newExpr;
 
-    return count;
+    return list;
 }
 
-/*
- * 1 if int, 0 if not
- */
-int isInt(double num) {
-    if ((num - trunc(num)) < .000001) {
-        return 1;
-    }
-    return 0;
+// val's value as a double, whichever lane it's in
+double toDouble(RET_VAL val) {
+    return val.type == INT_TYPE ? (double) val.ival : val.dval;
 }
 
+// Number of INT_TYPE operands; all-int and all-double calls get fast paths
+static int countIntOperands(RET_VAL *ops, int count) {
+    int ints = 0;
 
-RET_VAL evalNeg(AST_NODE *operand) {
-    if (operand == NULL) {
-        printf("WARNING: neg called with no operands! nan returned\n");
-        return NAN_RET_VAL;
-    }
-    else if (operand->next != NULL) {
-        printf("WARNING: neg called with extra (ignored) operands\n");
+    for (int i = 0; i < count; i++) {
+        ints += ops[i].type == INT_TYPE;
     }
 
-    RET_VAL retval;
+    return ints;
+}
 
-    // Populate retVal
-    retval.type = operand->data.number.type;
-    retval.value = (-1) * (operand->data.number.value);
 
-    return retval;
+RET_VAL evalNeg(CILISP_CONTEXT *ctx, RET_VAL *ops, int count) {
+    if (ops[0].type == INT_TYPE) {
+        // -INT64_MIN doesn't fit
+        if (ops[0].ival == INT64_MIN) {
+            return DOUBLE_RET_VAL(-(double) ops[0].ival);
+        }
+        return INT_RET_VAL(-ops[0].ival);
+    }
+
+    return DOUBLE_RET_VAL(-ops[0].dval);
 }
 
-RET_VAL evalAbs(AST_NODE *operand) {
-    if (operand == NULL) {
-        printf("WARNING: abs called with no operands! nan returned\n");
-        return NAN_RET_VAL;
-    }
-    else if (operand->next != NULL) {
-        printf("WARNING: abs called with extra (ignored) operands\n");
+RET_VAL evalAbs(CILISP_CONTEXT *ctx, RET_VAL *ops, int count) {
+    if (ops[0].type == INT_TYPE) {
+        if (ops[0].ival == INT64_MIN) {
+            return DOUBLE_RET_VAL(fabs((double) ops[0].ival));
+        }
+        return INT_RET_VAL(ops[0].ival < 0 ? -ops[0].ival : ops[0].ival);
     }
 
-    return (RET_VAL) {operand->data.number.type, fabs(operand->data.number.value)};
+    return DOUBLE_RET_VAL(fabs(ops[0].dval));
 }
 
-RET_VAL evalAdd(AST_NODE *opList) {
-    if (opList == NULL) {
-        printf("WARNING: add called with no operands! nan returned\n");
-        return ZERO_RET_VAL;
+RET_VAL evalAdd(CILISP_CONTEXT *ctx, RET_VAL *ops, int count) {
+    int ints = countIntOperands(ops, count);
+
+    if (ints == count) {
+        return evalAddInt(ctx, ops, count);
     }
-    else if (opList->next == NULL) {
-        return (RET_VAL) opList->data.number;
+    if (ints == 0) {
+        return evalAddDouble(ctx, ops, count);
     }
 
-    NUM_TYPE type = INT_TYPE;
-    AST_NODE *appends = opList;
     double sum = 0.0;
+    for (int i = 0; i < count; i++) {
+        sum += toDouble(ops[i]);
+    }
 
-    while (appends != NULL) {
-        if (appends->data.number.type == DOUBLE_TYPE) {
-            type = DOUBLE_TYPE;
-        }
-        sum += appends->data.number.value;
-        appends = appends->next;
+    return DOUBLE_RET_VAL(sum);
+}
+
+/*
+ * The Int and Double kernels are the builtins' specialized ones (see
+ * builtins.txt). inferTypes only picks them for calls whose operands are
+ * all of that type, so they don't check.
+ */
+RET_VAL evalAddInt(CILISP_CONTEXT *ctx, RET_VAL *ops, int count) {
+    int64_t sum;
+
+    if (sumIntOperands(ops, count, &sum)) {
+        return INT_RET_VAL(sum);
     }
 
-    if (type != DOUBLE_TYPE) {
-        return (RET_VAL) {INT_TYPE, sum};
+    // Overflowed
+    double dsum = 0.0;
+    for (int i = 0; i < count; i++) {
+        dsum += (double) ops[i].ival;
     }
 
-    return (RET_VAL) {DOUBLE_TYPE, sum};
+    return DOUBLE_RET_VAL(dsum);
 }
 
-RET_VAL evalSub(AST_NODE *opList) {
-    if (opList == NULL) {
-        printf("WARNING: sub called with no operands! nan returned\n");
-        return NAN_RET_VAL;
+RET_VAL evalAddDouble(CILISP_CONTEXT *ctx, RET_VAL *ops, int count) {
+    // The sum starts at 0.0, which would turn a lone -0.0 into 0.0
+    if (count == 1) {
+        return ops[0];
     }
-    else if (opList->next == NULL) {
-        printf("WARNING: sub called with only one operands! nan returned\n");
-        return NAN_RET_VAL;
+
+    return DOUBLE_RET_VAL(sumOperands(ops, count));
+}
+
+RET_VAL evalSub(CILISP_CONTEXT *ctx, RET_VAL *ops, int count) {
+    if (ops[0].type == INT_TYPE && ops[1].type == INT_TYPE) {
+        return evalSubInt(ctx, ops, 2);
     }
-    else if (opList->next->next != NULL) {
-        printf("WARNING: sub called with extra (ignored) operands\n");
+
+    return DOUBLE_RET_VAL(toDouble(ops[0]) - toDouble(ops[1]));
+}
+
+RET_VAL evalSubInt(CILISP_CONTEXT *ctx, RET_VAL *ops, int count) {
+    int64_t difference;
+
+    if (__builtin_sub_overflow(ops[0].ival, ops[1].ival, &difference)) {
+        return DOUBLE_RET_VAL((double) ops[0].ival - (double) ops[1].ival);
     }
 
-    RET_VAL retval;
-    retval.value = opList->data.number.value - opList->next->data.number.value;
-    retval.type = opList->data.number.type || opList->next->data.number.type; 
+    return INT_RET_VAL(difference);
+}
 
-    return retval;
+RET_VAL evalSubDouble(CILISP_CONTEXT *ctx, RET_VAL *ops, int count) {
+    return DOUBLE_RET_VAL(ops[0].dval - ops[1].dval);
 }
 
-RET_VAL evalMult(AST_NODE *opList) {
-    if (opList == NULL) {
-        printf("WARNING: mult called with no operands! nan returned\n");
-        return (RET_VAL) {INT_TYPE, 1.0};
+RET_VAL evalMult(CILISP_CONTEXT *ctx, RET_VAL *ops, int count) {
+    int ints = countIntOperands(ops, count);
+
+    if (ints == count) {
+        return evalMultInt(ctx, ops, count);
     }
-    else if (opList->next == NULL) {
-        return (RET_VAL) opList->data.number;
+    if (ints == 0) {
+        return evalMultDouble(ctx, ops, count);
     }
 
     double product = 1.0;
-    AST_NODE *factor = opList;
-    RET_VAL retval;
-    retval.type = INT_TYPE;
-
-    while (factor != NULL) {
-        if (factor->data.number.type == DOUBLE_TYPE) {
-            retval.type = DOUBLE_TYPE;
-        }
-        product *= factor->data.number.value;
-        factor = factor->next;
+    for (int i = 0; i < count; i++) {
+        product *= toDouble(ops[i]);
     }
 
-    retval.value = product;
+    return DOUBLE_RET_VAL(product);
+}
+
+RET_VAL evalMultInt(CILISP_CONTEXT *ctx, RET_VAL *ops, int count) {
+    int64_t product;
 
-    // Check protuct type
-    if (retval.type == INT_TYPE) {
-        return retval;
+    if (multiplyIntOperands(ops, count, &product)) {
+        return INT_RET_VAL(product);
     }
 
-    retval.type = DOUBLE_TYPE;
-    return retval;
+    // Overflowed
+    double dproduct = 1.0;
+    for (int i = 0; i < count; i++) {
+        dproduct *= (double) ops[i].ival;
+    }
+
+    return DOUBLE_RET_VAL(dproduct);
 }
 
-RET_VAL evalDiv(AST_NODE *opList) {
-    if (opList == NULL) {
-        printf("WARNING: div called with no operands! nan returned\n");
-        return NAN_RET_VAL;
-    }
-    else if (opList->next == NULL) {
-        printf("WARNING: div called with only one operand! nan returned\n");
-        return NAN_RET_VAL;
-    }
-    else if (opList->next->next != NULL) {
-        printf("WARNING: div called with extra (ignored) operands\n");
-    }
+RET_VAL evalMultDouble(CILISP_CONTEXT *ctx, RET_VAL *ops, int count) {
+    return DOUBLE_RET_VAL(multiplyOperands(ops, count));
+}
 
+RET_VAL evalDiv(CILISP_CONTEXT *ctx, RET_VAL *ops, int count) {
+    if (ops[0].type == INT_TYPE && ops[1].type == INT_TYPE) {
+        return evalDivInt(ctx, ops, 2);
+    }
 
-    double div;
-    AST_NUMBER op1 = opList->data.number;
-    AST_NUMBER op2 = opList->next->data.number;
+    return DOUBLE_RET_VAL(toDouble(ops[0]) / toDouble(ops[1]));
+}
 
-    div = op1.value / op2.value;
+RET_VAL evalDivInt(CILISP_CONTEXT *ctx, RET_VAL *ops, int count) {
+    int64_t dividend = ops[0].ival;
+    int64_t divisor = ops[1].ival;
 
-    // Integer divison
-    if (op1.type == INT_TYPE && op2.type == INT_TYPE) {
-        return (RET_VAL) {INT_TYPE, trunc(div)};
+    // Integer divison, truncating. x / 0 and INT64_MIN / -1 have no
+    // integer result, so they're done in doubles.
+    if (divisor == 0 || (dividend == INT64_MIN && divisor == -1)) {
+        return DOUBLE_RET_VAL((double) dividend / (double) divisor);
     }
 
-    return (RET_VAL) {DOUBLE_TYPE, div};
+    return INT_RET_VAL(dividend / divisor);
 }
 
-RET_VAL evalRem(AST_NODE *opList) {
-    if (opList == NULL) {
-        printf("WARNING: remainder called with no operands! nan returned\n");
-        return NAN_RET_VAL;
-    }
-    else if (opList->next == NULL) {
-        printf("WARNING: remainder called with only one operand! nan returned\n");
+RET_VAL evalDivDouble(CILISP_CONTEXT *ctx, RET_VAL *ops, int count) {
+    return DOUBLE_RET_VAL(ops[0].dval / ops[1].dval);
+}
+
+RET_VAL evalRem(CILISP_CONTEXT *ctx, RET_VAL *ops, int count) {
+    if (toDouble(ops[1]) == 0.0) {
+        fprintf(ctx->out, "WARNING: Divide by zero! nan returned\n");
         return NAN_RET_VAL;
     }
-    else if (opList->next->next != NULL) {
-        printf("WARNING: remainder called with extra (ignored) operands\n");
-    }
 
-    if (opList->next->data.number.value == 0.0) {
-        printf("WARNING: Divide by zero! nan returned\n");
-        return NAN_RET_VAL;
+    if (ops[0].type == INT_TYPE && ops[1].type == INT_TYPE) {
+        int64_t divisor = ops[1].ival;
+
+        // INT64_MIN % -1 overflows in C, but the remainder is 0
+        int64_t remainder = divisor == -1 ? 0 : ops[0].ival % divisor;
+
+        // Ensure the remainder is positive
+        if (remainder < 0) {
+            remainder += divisor < 0 ? -divisor : divisor;
+        }
+
+        return INT_RET_VAL(remainder);
     }
 
-    RET_VAL retval;
-    double dividen = opList->data.number.value;
-    double divisor = opList->next->data.number.value;
-    retval.type = opList->data.number.type || opList->next->data.number.type;
+    double dividen = toDouble(ops[0]);
+    double divisor = toDouble(ops[1]);
 
     double remainder = fmod(dividen, divisor);
 
@@ -439,314 +653,235 @@ RET_VAL evalRem(AST_NODE *opList) {
         remainder += fabs(divisor);
     }
 
-    retval.value = remainder;
+    return DOUBLE_RET_VAL(remainder);
+}
 
-    return retval; 
+RET_VAL evalExp(CILISP_CONTEXT *ctx, RET_VAL *ops, int count) {
+    return DOUBLE_RET_VAL(exp(toDouble(ops[0])));
 }
 
-RET_VAL evalExp(AST_NODE *opList) {
-    if (opList == NULL) {
-        printf("WARNING: exp called with no operands! nan returned\n");
-        return NAN_RET_VAL;
-    }
-    else if (opList->next != NULL) {
-        printf("WARNING: exp called with extra (ignored) operands\n");
+RET_VAL evalExp2(CILISP_CONTEXT *ctx, RET_VAL *ops, int count) {
+    // 2^n is an integer for integer n >= 0, as long as it fits
+    if (ops[0].type == INT_TYPE && ops[0].ival >= 0 && ops[0].ival < 63) {
+        return INT_RET_VAL((int64_t) 1 << ops[0].ival);
     }
 
-    return (RET_VAL) {DOUBLE_TYPE, exp(opList->data.number.value)};
+    return DOUBLE_RET_VAL(exp2(toDouble(ops[0])));
 }
 
-RET_VAL evalExp2(AST_NODE *opList) {
-    if (opList == NULL) {
-        printf("WARNING: exp2 called with no operands! nan returned\n");
-        return NAN_RET_VAL;
-    }
-    else if (opList->next != NULL) {
-        printf("WARNING: exp2 called with extra (ignored) operands\n");
-    }
-
-    RET_VAL retval;
-    double val = opList->data.number.value;
+// base^exponent by squaring; false if it overflows
+static bool powInt(int64_t base, int64_t exponent, int64_t *result) {
+    int64_t power = 1;
 
-    if (val < 0) {
-        retval.type = DOUBLE_TYPE;
-    }
-    else {
-        retval.type = opList->data.number.type;
+    while (exponent > 0) {
+        if ((exponent & 1) && __builtin_mul_overflow(power, base, &power)) {
+            return false;
+        }
+        exponent >>= 1;
+        if (exponent > 0 && __builtin_mul_overflow(base, base, &base)) {
+            return false;
+        }
     }
 
-    retval.value = exp2(val);
-
-    return retval;
+    *result = power;
+    return true;
 }
 
-RET_VAL evalPow(AST_NODE *opList) {
-    if (opList == NULL) {
-        printf("WARNING: pow called with no operands! nan returned\n");
-        return NAN_RET_VAL;
-    }
-    else if (opList->next == NULL) {
-        printf("WARNING: pow called with only one operands! nan returned\n");
-        return NAN_RET_VAL;
-    }
-    else if (opList->next->next != NULL) {
-        printf("WARNING: pow called with extra (ignored) operands\n");
-    }
+RET_VAL evalPow(CILISP_CONTEXT *ctx, RET_VAL *ops, int count) {
+    if (ops[0].type == INT_TYPE && ops[1].type == INT_TYPE) {
+        int64_t base = ops[0].ival;
+        int64_t exponent = ops[1].ival;
+        int64_t power;
 
-    RET_VAL retval;
-    retval.type = opList->data.number.type || opList->next->data.number.type;
-    retval.value = pow(opList->data.number.value, opList->next->data.number.value);
+        if (exponent >= 0 && powInt(base, exponent, &power)) {
+            return INT_RET_VAL(power);
+        }
+        // A negative power is only an integer for a base of 1 or -1; any
+        // other is a fraction, computed as a double below
+        if (exponent < 0 && (base == 1 || base == -1)) {
+            return INT_RET_VAL(exponent % 2 == 0 ? 1 : base);
+        }
+    }
 
-    return retval;
+    return DOUBLE_RET_VAL(pow(toDouble(ops[0]), toDouble(ops[1])));
+}
 
+RET_VAL evalLog(CILISP_CONTEXT *ctx, RET_VAL *ops, int count) {
+    return DOUBLE_RET_VAL(log(toDouble(ops[0])));
 }
 
-RET_VAL evalLog(AST_NODE *opList) {
-    if (opList == NULL) {
-        printf("WARNING: log called with no operands! nan returned\n");
-        return NAN_RET_VAL;
-    }
-    else if (opList->next != NULL) {
-        printf("WARNING: log called with extra (ignored) operands!\n");
-    }
+RET_VAL evalSqrt(CILISP_CONTEXT *ctx, RET_VAL *ops, int count) {
+    return DOUBLE_RET_VAL(sqrt(toDouble(ops[0])));
+}
 
-    return (RET_VAL) {DOUBLE_TYPE, log(opList->data.number.value)};
+RET_VAL evalCbrt(CILISP_CONTEXT *ctx, RET_VAL *ops, int count) {
+    return DOUBLE_RET_VAL(cbrt(toDouble(ops[0])));
 }
 
-RET_VAL evalSqrt(AST_NODE *opList) {
-    if (opList == NULL) {
-        printf("WARNING: sqrt called with no operands! nan returned\n");
-        return NAN_RET_VAL;
+RET_VAL evalHypot(CILISP_CONTEXT *ctx, RET_VAL *ops, int count) {
+    if (countIntOperands(ops, count) == 0) {
+        return evalHypotDouble(ctx, ops, count);
     }
-    else if (opList->next != NULL) {
-        printf("WARNING: sqrt called with extra (ignored) operands!\n");
+
+    double sum = 0.0;
+    for (int i = 0; i < count; i++) {
+        sum += pow(toDouble(ops[i]), 2);
     }
 
-    return (RET_VAL) {DOUBLE_TYPE, sqrt(opList->data.number.value)};
+    return DOUBLE_RET_VAL(sqrt(sum));
 }
 
-RET_VAL evalCbrt(AST_NODE *opList) {
-    if (opList == NULL) {
-        printf("WARNING: cbrt called with no operands! nan returned\n");
-        return NAN_RET_VAL;
-    }
-    else if (opList->next != NULL) {
-        printf("WARNING: cbrt called with extra (ignored) operands!\n");
-    }
-
-    return (RET_VAL) {DOUBLE_TYPE, cbrt(opList->data.number.value)};
+RET_VAL evalHypotDouble(CILISP_CONTEXT *ctx, RET_VAL *ops, int count) {
+    return DOUBLE_RET_VAL(sqrt(sumSquaredOperands(ops, count)));
 }
 
-RET_VAL evalHypot(AST_NODE *opList) {
-    if (opList == NULL) {
-        printf("WARNING: hypot called with no operands! 0 returned\n");
-        return (RET_VAL) {DOUBLE_TYPE, 0.0};
+// Index of the first greatest (or smallest) of count INT_TYPE operands
+static int extremeIntOperand(RET_VAL *ops, int count, bool greatest) {
+    int best = 0;
+
+    for (int i = 1; i < count; i++) {
+        if (greatest ? ops[i].ival > ops[best].ival : ops[i].ival < ops[best].ival) {
+            best = i;
+        }
     }
 
-    RET_VAL retval;
-    retval.type = DOUBLE_TYPE;
-    
-    AST_NODE *cur = opList;
-    double sum = 0.0;
+    return best;
+}
 
-    while (cur != NULL) {
-        sum += pow(cur->data.number.value, 2);
-        cur = cur->next;
+// Index of the first greatest (or smallest) operand. NANs are skipped
+// unless ops[0] is one.
+static int extremeOperand(RET_VAL *ops, int count, bool greatest) {
+    int ints = countIntOperands(ops, count);
+    int best = 0;
+
+    if (ints == 0) {
+        return greatest ? maxOperand(ops, count) : minOperand(ops, count);
+    }
+    if (ints == count) {
+        return extremeIntOperand(ops, count, greatest);
     }
 
-    retval.value = sqrt(sum);
+    for (int i = 1; i < count; i++) {
+        double current = toDouble(ops[best]);
+        if (greatest ? current < fmax(current, toDouble(ops[i]))
+                     : current > fmin(current, toDouble(ops[i]))) {
+            best = i;
+        }
+    }
 
-    return retval;
+    return best;
 }
 
 /*
  * Min op: 2
  * Max op: none
  */
-RET_VAL evalMax(AST_NODE *opList) {
-    if (opList == NULL) {
-        printf("WARNING: max called with no operands! nan returned\n");
-        return NAN_RET_VAL;
-    }
+RET_VAL evalMax(CILISP_CONTEXT *ctx, RET_VAL *ops, int count) {
+    // The first greatest operand, keeping its type
+    return ops[extremeOperand(ops, count, true)];
+}
 
-    NUM_TYPE type = opList->data.number.type;
-    double max = opList->data.number.value;
+RET_VAL evalMaxInt(CILISP_CONTEXT *ctx, RET_VAL *ops, int count) {
+    return ops[extremeIntOperand(ops, count, true)];
+}
 
-    AST_NODE *ptr = opList->next;
+RET_VAL evalMaxDouble(CILISP_CONTEXT *ctx, RET_VAL *ops, int count) {
+    return ops[maxOperand(ops, count)];
+}
 
-    while (ptr != NULL) {
-        if (max < fmax(max, ptr->data.number.value)) {
-            // Set new max and type
-            max = ptr->data.number.value;
-            type = ptr->data.number.type;
-        }
 
-        ptr = ptr->next;
-    }
+/*
+ * Min op: 2
+ * Max op: none
+ */
+RET_VAL evalMin(CILISP_CONTEXT *ctx, RET_VAL *ops, int count) {
+    // The first smallest operand, keeping its type
+    return ops[extremeOperand(ops, count, false)];
+}
 
-    return (RET_VAL) {type, max};
+RET_VAL evalMinInt(CILISP_CONTEXT *ctx, RET_VAL *ops, int count) {
+    return ops[extremeIntOperand(ops, count, false)];
 }
 
+RET_VAL evalMinDouble(CILISP_CONTEXT *ctx, RET_VAL *ops, int count) {
+    return ops[minOperand(ops, count)];
+}
 
 /*
- * Min op: 2
- * Max op: none
+ * Applies builtin func to count already evaluated operands. func comes
+ * from resolveFunc, so it's always a valid index into builtins.
  */
-RET_VAL evalMin(AST_NODE *opList) {
-    // Check for opperands
-    if (opList == NULL) {
-        printf("WARNING: min called with no operands! nan returned\n");
-        return NAN_RET_VAL;
+RET_VAL applyBuiltin(CILISP_CONTEXT *ctx, FUNC_TYPE func, RET_VAL *ops, int count)
+{
+    return builtins[func].apply(ctx, ops, count);
+}
+
+/*
+ * The kernel to call a function node's builtin with: the one specialized
+ * for its operands' type if inferTypes picked one, the generic one
+ * otherwise. Shared by the tree walker and the bytecode compiler, which
+ * looks it up once per call site.
+ */
+BUILTIN_KERNEL nodeKernel(AST_NODE *node)
+{
+    const BUILTIN *builtin = &builtins[node->subtype];
+
+    switch (node->kernelType) {
+        case INT_TYPE:    return builtin->applyInt;
+        case DOUBLE_TYPE: return builtin->applyDouble;
+        default:          return builtin->apply;
     }
+}
 
-    NUM_TYPE type = opList->data.number.type;
-    double min = opList->data.number.value;
+/*
+ * 1 if func's result depends only on its operands. Every builtin so far
+ * is; rand, read and print won't be.
+ */
+int isPureBuiltin(FUNC_TYPE func) {
+    return func >= 0 && func < CUSTOM_FUNC;
+}
 
-    AST_NODE *ptr = opList->next;
+/*
+ * Turns a call to a pure builtin whose operands are all numbers into a
+ * number node holding its result. Divisions by zero are left alone so
+ * the warning still shows up when (and if) they're evaluated.
+ */
+NODE_INDEX foldConstants(CILISP_CONTEXT *ctx, NODE_INDEX index) {
+    AST_NODE *node = &ctx->tree.nodes[index];
+    FUNC_TYPE func = node->subtype;
+    int count = node->data.function.count;
+    NODE_INDEX *opNodes = ctx->tree.operands + node->data.function.first;
 
-    while (ptr != NULL) {
-        if (min > fmin(min, ptr->data.number.value)) {
-            // Set new min and type
-            min = ptr->data.number.value;
-            type = ptr->data.number.type;
+    if (!isPureBuiltin(func)) {
+        return index;
+    }
 
+    for (int i = 0; i < count; i++) {
+        if (ctx->tree.nodes[opNodes[i]].type != NUM_NODE_TYPE) {
+            return index;
         }
-        ptr = ptr->next;
     }
 
-    return (RET_VAL) {type, min};
-}
+    if (func == REM_FUNC && toDouble(evalNumNode(&ctx->tree.nodes[opNodes[1]])) == 0.0) {
+        return index;
+    }
 
-RET_VAL evalFuncNode(AST_NODE *node);
+    RET_VAL *ops = malloc(sizeof(RET_VAL) * (count + 1));
+    if (ops == NULL) {
+        yyerror("Memory allocation failed!");
+    }
 
-/*
- * Resolves all functions in an opList and returns the new list
- * */
-AST_NODE *resolveOperandList(AST_NODE *opList) {
-
-    AST_NODE *op = opList;
-
-    while (op != NULL) {
-        switch(op->type) {
-            case FUNC_NODE_TYPE:
-                // Replace .data.func with value of resolved func
-                op->data.number = evalFuncNode(op);
-                op->type = NUM_NODE_TYPE;
-                // Move to next
-                op = op->next;
-                break;
-            case SCOPE_NODE_TYPE:
-                // Let expression
-                op->data.number = evalScopeNode(op);
-                op->type = NUM_NODE_TYPE;
-                op = op->next;
-                break;
-            case SYM_NODE_TYPE:
-                op->data.number = evalSymNode(op);
-                op->type = NUM_NODE_TYPE;
-                op = op->next;
-                break;
-            case NUM_NODE_TYPE:
-                op = op->next;
-        }
+    for (int i = 0; i < count; i++) {
+        ops[i] = evalNumNode(&ctx->tree.nodes[opNodes[i]]);
     }
-    return opList;
 
-}
+    RET_VAL result = applyBuiltin(ctx, func, ops, count);
+    node->type = NUM_NODE_TYPE;
+    setNumber(node, result);
 
-/*
- *
- * */
-RET_VAL evalFuncNode(AST_NODE *node)
-{
-    if (!node)
-    {
-        yyerror("NULL ast node passed into evalFuncNode!");
-        return NAN_RET_VAL; // unreachable but kills a clang-tidy warning
-    }
-    // Check for valid function type (need to do bcs using look-up table)
-    else if (node->data.function.func < 0 ||
-             node->data.function.func > CUSTOM_FUNC) { // last element in FUNC_TYPE enum
-        yyerror("Invalid function type in node passed into evalFuncNode!");
-        return NAN_RET_VAL; 
-    }
-
-    FUNC_TYPE funcType = node->data.function.func;
-    AST_NODE *opList = node->data.function.opList;
-
-    // Make all operands num_node_type
-    if (opList != NULL) {
-        opList = resolveOperandList(opList);
-    }
-
-    // Function lookup table. NOTE: Depends on correct order
-    RET_VAL (*functionTable[FUNC_COUNT])(AST_NODE *) = {
-		evalNeg,
-		evalAbs,
-		evalAdd,
-		evalSub,
-		evalMult,
-		evalDiv,
-		evalRem,
-		evalExp,
-		evalExp2,
-		evalPow,
-		evalLog,
-		evalSqrt,
-		evalCbrt,
-		evalHypot,
-		evalMax,
-		evalMin
-    };
-
-    // Call corrisponding function  NOTE: Passing in opList
-    return functionTable[funcType](opList);
-
-    /*
-    //  could use a sorta look-up table here but thats for another time
-    // Decide function
-    switch (node->data.function.func) {
-        case NEG_FUNC:
-            return evalNeg(node);
-        case ABS_FUNC:
-            return evalAbs(node);
-        case ADD_FUNC:
-            return evalAdd(node);
-        case SUB_FUNC:
-            return evalSub(node);
-        case MULT_FUNC:
-            return evalMult(node);
-        case DIV_FUNC:
-            return evalDiv(node);
-        case REM_FUNC:
-            return evalRem(node);
-        case EXP_FUNC:
-            return evalExp(node);
-        case EXP2_FUNC:
-            return evalExp2(node);
-        case POW_FUNC:
-            return evalPow(node);
-        case LOG_FUNC:
-            return evalLog(node);
-        case SQRT_FUNC:
-            return evalSqrt(node);
-        case CBRT_FUNC:
-            return evalCbrt(node);
-        case HYPOT_FUNC:
-            return evalHypot(node);
-        case MAX_FUNC:
-            return evalMax(node);
-        case MIN_FUNC:
-            return evalMin(node);
-        case CUSTOM_FUNC:
-            yyerror("Custom func not setup yet\n");
-        defualt:
-            yyerror("Error in evalFuncNode(), node.data.function.func likely not set\n");
-    }
-
-
-    return NAN_RET_VAL; // Paranotic
-    */
+    free(ops);
+
+    return index;
 }
 
 RET_VAL evalNumNode(AST_NODE *node)
@@ -757,83 +892,376 @@ RET_VAL evalNumNode(AST_NODE *node)
         return NAN_RET_VAL;
     }
 
-    return (RET_VAL) {node->data.number.type, node->data.number.value};
+    if (node->subtype == INT_TYPE) {
+        return INT_RET_VAL(node->data.integer);
+    }
+
+    return DOUBLE_RET_VAL(node->data.number);
 }
 
-//TODO: may be error here
-RET_VAL evalSymNode(AST_NODE *node) {
-    char* id = node->data.symbol.id;
+/*
+ * Lexical addressing. resolveSymbols runs once on every parsed expression
+ * and gives each symbol node the (depth, slot) of the let definition it
+ * refers to: depth counts the scopes enclosing that definition and slot is
+ * its position in their innermost symbol table. Evaluating a symbol is then
+ * an indexed load instead of a search through the symbol tables.
+ * ctx->scopeChain[d] is the symbol table in scope at depth d.
+ */
+
+// ctx->resolveStack holds the nodes still to be resolved, next one last.
+// Kept off the C stack so deep expressions can't overflow it.
+static void pushResolve(CILISP_CONTEXT *ctx, NODE_INDEX node, int depth)
+{
+    ctx->resolveStack = growArray(ctx->resolveStack, ctx->resolveCount, &ctx->resolveCap, sizeof(RESOLVE_ITEM));
+    ctx->resolveStack[ctx->resolveCount++] = (RESOLVE_ITEM) {node, depth};
+}
+
+// Resolves one node and queues its children. Last in is first out, so a
+// child's subtree is done before its next sibling is started and the
+// ctx->scopeChain entries it relies on can't have been replaced.
+static void resolveNode(CILISP_CONTEXT *ctx, NODE_INDEX index, int depth)
+{
+    AST_NODE *node = &ctx->tree.nodes[index];
     SYMBOL_TABLE_NODE *sym;
+    AST_SYMBOL *symbol;
+    AST_SCOPE *scope;
+    int slot, first;
 
-    // If node has a symbol table search it
-    if ((sym = findSymbol(id, node->symbolTable)) == NULL) {
-        // Symbol not found in current node symbol table search parents'
-        //printf("--%s NOT found in (%p) symtable\n",id,node);
-        AST_NODE *parent = node->parent;
-        while (parent != NULL) {
-            if((sym = findSymbol(id, parent->symbolTable)) != NULL) {
-                // Symbol found
-                break;
+    switch (node->type) {
+        case NUM_NODE_TYPE:
+            break;
+        case FUNC_NODE_TYPE:
+            for (int i = node->data.function.count - 1; i >= 0; i--) {
+                pushResolve(ctx, ctx->tree.operands[node->data.function.first + i], depth);
             }
-            //printf("--%s NOT found in (%p) symtable\n",id,parent);
-            parent = parent->parent;
-        }
+            break;
+        case SYM_NODE_TYPE:
+            symbol = &ctx->tree.symbols[node->data.symbol.index];
+
+            // Innermost definition first
+            for (int d = depth - 1; d >= 0; d--) {
+                if ((sym = findSymbol(symbol->id, ctx->scopeChain[d])) != NULL) {
+                    symbol->depth = d;
+                    symbol->slot = sym->slot;
+                    symbol->definition = sym;
+                    return;
+                }
+            }
+            symbol->depth = -1;
+            symbol->definition = NULL;
+            if (!ctx->compiling) {
+                // cilisp_compile makes it a free variable instead
+                fprintf(ctx->out, "WARNING: Undefined symbol \"%s\"! NAN will be used!\n", symbol->id);
+            }
+            break;
+        case SCOPE_NODE_TYPE:
+            scope = &ctx->tree.scopes[node->data.scope.index];
+            ctx->scopeChain = growArray(ctx->scopeChain, depth, &ctx->scopeChainCap, sizeof(SYMBOL_TABLE_NODE *));
+            ctx->scopeChain[depth] = scope->symbolTable;
+
+            slot = 0;
+            for (sym = scope->symbolTable; sym != NULL; sym = sym->next) {
+                sym->slot = slot++;
+            }
+            scope->depth = depth;
+            scope->slotCount = slot;
+
+            // Let values see their own scope's definitions too. They're
+            // resolved in order, then the child.
+            pushResolve(ctx, node->data.scope.child, depth + 1);
+            first = ctx->resolveCount;
+            for (sym = scope->symbolTable; sym != NULL; sym = sym->next) {
+                pushResolve(ctx, sym->value, depth + 1);
+            }
+            for (int i = first, j = ctx->resolveCount - 1; i < j; i++, j--) {
+                RESOLVE_ITEM item = ctx->resolveStack[i];
+                ctx->resolveStack[i] = ctx->resolveStack[j];
+                ctx->resolveStack[j] = item;
+            }
+            break;
+    }
+}
+
+// Undefined symbols are reported here, once, rather than whenever they're evaluated
+void resolveSymbols(CILISP_CONTEXT *ctx, NODE_INDEX root)
+{
+    pushResolve(ctx, root, 0);
+
+    while (ctx->resolveCount > 0) {
+        RESOLVE_ITEM item = ctx->resolveStack[--ctx->resolveCount];
+        resolveNode(ctx, item.node, item.depth);
+    }
+}
+
+/*
+ * Static types. inferTypes runs after resolveSymbols and sets each node's
+ * numType to the NUM_TYPE its value has however it's evaluated, or to
+ * UNKNOWN_TYPE when that depends on the values (an integer add can overflow
+ * into a double). A function call whose operands all have one known type
+ * gets kernelType set to that type if its builtin has a kernel specialized
+ * for it; evaluating the call then skips the per-operand type checks. Let values are typed once, the first time a symbol needs them;
+ * a symbol met while its own value is being typed is circular, and unknown.
+ *
+ * inferTypes recurses on the C stack, so it stops INFER_DEPTH_LIMIT nodes
+ * down and leaves anything deeper UNKNOWN_TYPE, which is always safe.
+ */
+#define INFER_DEPTH_LIMIT 10000
+
+static NUM_TYPE inferNode(CILISP_CONTEXT *ctx, NODE_INDEX index, int depth);
+
+static NUM_TYPE inferFuncNode(CILISP_CONTEXT *ctx, AST_NODE *node, int depth)
+{
+    const BUILTIN *builtin = &builtins[node->subtype];
+    int count = node->data.function.count;
+    NUM_TYPE shared = UNKNOWN_TYPE; // the type all operands have, if any
+    bool anyDouble = false;
+
+    for (int i = 0; i < count; i++) {
+        NUM_TYPE type = inferNode(ctx, ctx->tree.operands[node->data.function.first + i], depth + 1);
+        shared = i == 0 || type == shared ? type : UNKNOWN_TYPE;
+        anyDouble |= type == DOUBLE_TYPE;
+    }
+
+    if ((shared == INT_TYPE && builtin->applyInt) || (shared == DOUBLE_TYPE && builtin->applyDouble)) {
+        node->kernelType = shared;
+    }
+
+    switch (builtin->result) {
+        case DOUBLE_RESULT:   return DOUBLE_TYPE;
+        case PROMOTED_RESULT: return anyDouble ? DOUBLE_TYPE : UNKNOWN_TYPE;
+        case OPERAND_RESULT:  return shared;
     }
 
+    return UNKNOWN_TYPE;
+}
+
+static NUM_TYPE inferSymNode(CILISP_CONTEXT *ctx, AST_NODE *node, int depth)
+{
+    SYMBOL_TABLE_NODE *sym = ctx->tree.symbols[node->data.symbol.index].definition;
+
     if (sym == NULL) {
-        // Symbol not found
-        printf("WARNING: Undefined symbol \"%s\" evaluated! NAN returned!\n", id);
-        return NAN_RET_VAL;
+        // Undefined, NAN, unless it's a free variable cilisp_bind can set
+        return ctx->compiling ? UNKNOWN_TYPE : DOUBLE_TYPE;
+    }
+    if (sym->typeState == UNEVALUATED) {
+        sym->typeState = EVALUATING;
+        sym->type = inferNode(ctx, sym->value, depth + 1);
+        sym->typeState = EVALUATED;
     }
 
-    //printf("--%s found!!\n",id);
+    return sym->typeState == EVALUATED ? sym->type : UNKNOWN_TYPE;
+}
 
-    // Symbol found
-    AST_NODE *value = sym->value;
+static NUM_TYPE inferNode(CILISP_CONTEXT *ctx, NODE_INDEX index, int depth)
+{
+    AST_NODE *node = &ctx->tree.nodes[index];
 
-    if (value->type != NUM_NODE_TYPE) {
-        // Comepute and replace non-number node with number-node
-        value->data.number = (AST_NUMBER) callNodeTypeEval(value);
-        value->type = NUM_NODE_TYPE;
+    if (depth > INFER_DEPTH_LIMIT) {
+        return UNKNOWN_TYPE;
     }
 
-    //printf("---------evalsymNode-----3\n");
+    switch (node->type) {
+        case NUM_NODE_TYPE:
+            node->numType = node->subtype;
+            break;
+        case FUNC_NODE_TYPE:
+            node->numType = inferFuncNode(ctx, node, depth);
+            break;
+        case SYM_NODE_TYPE:
+            node->numType = inferSymNode(ctx, node, depth);
+            break;
+        case SCOPE_NODE_TYPE:
+            node->numType = inferNode(ctx, node->data.scope.child, depth + 1);
+            break;
+    }
 
-    return (RET_VAL) value->data.number;
+    return node->numType;
+}
+
+void inferTypes(CILISP_CONTEXT *ctx, NODE_INDEX root)
+{
+    inferNode(ctx, root, 0);
 }
 
-RET_VAL evalScopeNode(AST_NODE *node) {
-    // Check for no child
-    if (node->data.scope.child == NULL) {
-        printf("ERROR : evalScopeNode called with NULL child\n");
-        return NAN_RET_VAL; // Paranotic, shouldn't pass yacc
+/*
+ * The tree walker. Rather than recursing on the C stack, which deep input
+ * overflows, it keeps its own stack of EVAL_FRAMEs, one per node being
+ * evaluated, and a stack of the values computed so far: a node's frame
+ * stays on top until its value has been pushed. The walker gives up with
+ * a warning (and NAN) rather than nest more than ctx->maxDepth frames, so
+ * deep input costs memory proportional to its depth and never crashes.
+ *
+ * ctx->letValues has the slots of the scopes the walker is in, and
+ * ctx->frameBase[d] is the index there of the first slot of the current
+ * scope at depth d. They're kept apart from the AST so a tree can be
+ * evaluated more than once.
+ */
+
+// Starts evaluating node; false if that would nest deeper than ctx->maxDepth
+static bool pushEvalFrame(CILISP_CONTEXT *ctx, NODE_INDEX node)
+{
+    if (ctx->evalFrameCount >= ctx->maxDepth) {
+        return false;
     }
 
-    return callNodeTypeEval(node->data.scope.child);
+    ctx->evalFrames = growArray(ctx->evalFrames, ctx->evalFrameCount, &ctx->evalFrameCap, sizeof(EVAL_FRAME));
+    ctx->evalFrames[ctx->evalFrameCount++] = (EVAL_FRAME) {node, 0, 0, 0};
+
+    return true;
 }
 
-RET_VAL callNodeTypeEval(AST_NODE *node)
+// Ends the top frame with value as its node's value
+static void popEvalFrame(CILISP_CONTEXT *ctx, RET_VAL value)
 {
-    if (!node)
+    ctx->evalFrameCount--;
+    ctx->evalValues = growArray(ctx->evalValues, ctx->evalValueCount, &ctx->evalValueCap, sizeof(RET_VAL));
+    ctx->evalValues[ctx->evalValueCount++] = value;
+}
+
+// Pushes a frame of unevaluated slots for the scope's definitions and
+// returns the index of the first
+static int enterScope(CILISP_CONTEXT *ctx, AST_SCOPE *scope, int *savedBase)
+{
+    SYMBOL_TABLE_NODE *sym;
+    int base = ctx->letValueCount;
+
+    ctx->letValues = growArray(ctx->letValues, base + scope->slotCount - 1, &ctx->letValueCap, sizeof(LET_VALUE));
+    if (scope->depth >= ctx->frameBaseCap) {
+        int oldCap = ctx->frameBaseCap;
+        int cap = 2 * scope->depth + 16;
+        int *frameBase = realloc(ctx->frameBase, sizeof(int) * cap);
+
+        if (frameBase == NULL) {
+            yyerror("Memory allocation failed!");
+        }
+        memset(frameBase + oldCap, 0, sizeof(int) * (cap - oldCap));
+        ctx->frameBase = frameBase;
+        ctx->frameBaseCap = cap;
+    }
+    for (sym = scope->symbolTable; sym != NULL; sym = sym->next) {
+        ctx->letValues[base + sym->slot] = (LET_VALUE) {sym, UNEVALUATED, NAN_RET_VAL};
+    }
+    ctx->letValueCount += scope->slotCount;
+
+    // A let value evaluated from a deeper scope can have scopes of its own
+    // at this depth, so the outer frame is put back afterwards
+    *savedBase = ctx->frameBase[scope->depth];
+    ctx->frameBase[scope->depth] = base;
+
+    return base;
+}
+
+// Moves the top frame on by one step
+static bool stepEval(CILISP_CONTEXT *ctx)
+{
+    EVAL_FRAME *frame = &ctx->evalFrames[ctx->evalFrameCount - 1];
+    AST_NODE *node = &ctx->tree.nodes[frame->node];
+    AST_SYMBOL *symbol;
+    AST_SCOPE *scope;
+    LET_VALUE *letValue;
+    int count;
+
+    switch (node->type) {
+        case NUM_NODE_TYPE:
+            popEvalFrame(ctx, evalNumNode(node));
+            return true;
+
+        case FUNC_NODE_TYPE:
+            count = node->data.function.count;
+            if (frame->step == 0) {
+                frame->base = ctx->evalValueCount;
+            }
+            if (frame->step < count) {
+                // Evaluate the next operand onto the value stack
+                return pushEvalFrame(ctx, ctx->tree.operands[node->data.function.first + frame->step++]);
+            }
+
+            // All evaluated; call the builtin on them where they are
+            ctx->evalValueCount = frame->base;
+            popEvalFrame(ctx, nodeKernel(node)(ctx, ctx->evalValues + frame->base, count));
+            return true;
+
+        case SYM_NODE_TYPE:
+            symbol = &ctx->tree.symbols[node->data.symbol.index];
+            if (frame->step == 1) {
+                // The value just computed is both the definition's and this node's
+                letValue = &ctx->letValues[frame->base];
+                letValue->value = ctx->evalValues[ctx->evalValueCount - 1];
+                letValue->state = EVALUATED;
+                ctx->evalFrameCount--;
+                return true;
+            }
+            if (symbol->depth < 0) {
+                // Undefined, already reported by resolveSymbols
+                popEvalFrame(ctx, NAN_RET_VAL);
+                return true;
+            }
+
+            // Compute the symbol's value the first time it's used in its scope
+            frame->base = ctx->frameBase[symbol->depth] + symbol->slot;
+            letValue = &ctx->letValues[frame->base];
+            if (letValue->state == EVALUATED) {
+                popEvalFrame(ctx, letValue->value);
+                return true;
+            }
+            if (letValue->state == EVALUATING) {
+                fprintf(ctx->out, "WARNING: Circular definition of \"%s\" evaluated! NAN returned!\n", symbol->id);
+                popEvalFrame(ctx, NAN_RET_VAL);
+                return true;
+            }
+            letValue->state = EVALUATING;
+            frame->step = 1;
+            return pushEvalFrame(ctx, symbol->definition->value);
+
+        case SCOPE_NODE_TYPE:
+            scope = &ctx->tree.scopes[node->data.scope.index];
+            if (frame->step == 1) {
+                // The child's value is the scope's
+                ctx->frameBase[scope->depth] = frame->savedBase;
+                ctx->letValueCount = frame->base;
+                ctx->evalFrameCount--;
+                return true;
+            }
+            frame->base = enterScope(ctx, scope, &frame->savedBase);
+            frame->step = 1;
+            return pushEvalFrame(ctx, node->data.scope.child);
+    }
+
+    return true;
+}
+
+RET_VAL callNodeTypeEval(CILISP_CONTEXT *ctx, NODE_INDEX index)
+{
+    if (index == NO_NODE)
     {
         yyerror("NULL ast node passed into callNodeTypeEval!");
         return NAN_RET_VAL;
     }
 
-    switch (node->type) {
-        case NUM_NODE_TYPE:   return evalNumNode(node);
-        case FUNC_NODE_TYPE:  return evalFuncNode(node);
-        case SYM_NODE_TYPE:   return evalSymNode(node);
-        case SCOPE_NODE_TYPE: return evalScopeNode(node);
+    bool ok = pushEvalFrame(ctx, index);
+
+    while (ok && ctx->evalFrameCount > 0) {
+        ok = stepEval(ctx);
     }
 
-    return NAN_RET_VAL;
+    if (!ok) {
+        fprintf(ctx->out, "WARNING: Expression nested deeper than %d levels! NAN returned!\n", ctx->maxDepth);
+
+        // Nothing of this evaluation is needed any more. ctx->frameBase doesn't
+        // need putting back: every scope sets its entry before it's used.
+        ctx->evalFrameCount = 0;
+        ctx->evalValueCount = 0;
+        ctx->letValueCount = 0;
+        return NAN_RET_VAL;
+    }
+
+    return ctx->evalValues[--ctx->evalValueCount];
 }
 
 // I don't think I need to helper function callNodeTypeEval() as eval is only ever called on the root
-RET_VAL eval(AST_NODE *root)
+RET_VAL eval(CILISP_CONTEXT *ctx, NODE_INDEX root)
 {
-    if (!root)
+    if (root == NO_NODE)
     {
         yyerror("NULL ast node passed into eval!");
         return NAN_RET_VAL;
@@ -841,52 +1269,36 @@ RET_VAL eval(AST_NODE *root)
 
     //setParents(root); NOTE: Isn't this alread done when creating scope node?
 
-    return callNodeTypeEval(root);
+    // An expression evaluated once is cheaper to walk than to compile and
+    // run; the VM pays off for libcilisp's handles, which run many times
+    if (!ctx->vm) {
+        return callNodeTypeEval(ctx, root);
+    }
+
+    CHUNK *chunk = compileChunk(ctx, root);
+    if (chunk == NULL) {
+        return NAN_RET_VAL; // too deep, already reported
+    }
+    RET_VAL retval = runChunk(ctx, chunk);
+    freeChunk(chunk);
+
+    return retval;
 }
 
 // prints the type and value of a RET_VAL
-void printRetVal(RET_VAL val)
+void printRetVal(CILISP_CONTEXT *ctx, RET_VAL val)
 {
     switch (val.type)
     {
         case INT_TYPE:
-            printf("Integer : %.lf\n", val.value);
+            fprintf(ctx->out, "Integer : %" PRId64 "\n", val.ival);
             break;
         case DOUBLE_TYPE:
-            printf("Double : %lf\n", val.value);
+            fprintf(ctx->out, "Double : %lf\n", val.dval);
             break;
         default:
-            printf("No Type : %lf\n", val.value);
+            fprintf(ctx->out, "No Type : %lf\n", val.dval);
             break;
     }
 }
 
-void freeOperands(AST_NODE *opList) {
-    AST_NODE *prev;
-
-    while (opList != NULL) {
-        prev = opList;
-        opList = opList->next;
-        free(prev);
-    }
-}
-
-
-void freeNode(AST_NODE *node)
-{
-    if (!node)
-    {
-        return;
-    }
-
-    // TODO: Update for symbols
-
-    if (node->type == FUNC_NODE_TYPE) {
-        freeOperands(node->data.function.opList);
-    }
-    else if (node->next != NULL) {
-        freeOperands(node->next);
-    }
-
-    free(node);
-}
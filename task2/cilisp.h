@@ -7,73 +7,87 @@
 #include <string.h>
 #include <math.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <setjmp.h>
 
-
-#define NAN_RET_VAL (RET_VAL){DOUBLE_TYPE, NAN}
-#define ZERO_RET_VAL (RET_VAL){INT_TYPE, 0}
+#include "libcilisp.h" // RET_VAL, CILISP_CONTEXT and the library's functions
 
 
 #define BISON_FLEX_LOG_PATH "bison_flex.log" 
-FILE* read_target;
-FILE* flex_bison_log_file;
+#define DEFAULT_MAX_DEPTH 1000000
 size_t yyreadline(char **lineptr, size_t *n, FILE *stream, size_t n_terminate);
+void yyprintline(FILE *out, char *line, size_t len, size_t n_extra_terminates);
+char *yymapfile(FILE *stream, size_t *n, size_t n_terminate);
+void yyunmapfile(char *buf, size_t len);
+
+
+// Where yyerror goes instead of exiting while the library is running a
+// call for its host (see libcilisp.c); NULL everywhere else
+typedef struct {
+    jmp_buf jump;
+    char message[256];
+} ERROR_TRAP;
 
+extern _Thread_local ERROR_TRAP *errorTrap;
 
-int yyparse(void);
-int yylex(void);
 void yyerror(char *, ...);
-void warning(char*, ...);
+void printError(FILE *out, char *message);
+void warning(CILISP_CONTEXT *ctx, char*, ...);
+void parseError(CILISP_CONTEXT *ctx, char *message);
+void runJobs(CILISP_CONTEXT *ctx, char *text, size_t length);
+void runServer(CILISP_CONTEXT *ctx, char *path);
+int runClient(char *path, FILE *in);
 
 
-typedef enum func_type {
-    NEG_FUNC,
-    ABS_FUNC,
-    ADD_FUNC,
-    SUB_FUNC,
-    MULT_FUNC,
-    DIV_FUNC,
-    REM_FUNC,
-    EXP_FUNC,
-    EXP2_FUNC,
-    POW_FUNC,
-    LOG_FUNC,
-    SQRT_FUNC,
-    CBRT_FUNC,
-    HYPOT_FUNC,
-    MAX_FUNC,
-    MIN_FUNC,
-    CUSTOM_FUNC
-} FUNC_TYPE;
+#include "builtins.h" // FUNC_TYPE, generated from builtins.txt
 
 
-FUNC_TYPE resolveFunc(char *);
+FUNC_TYPE resolveFunc(const char *name);
+char *internSymbol(CILISP_CONTEXT *ctx, const char *name);
 
 
-typedef enum num_type {
-    INT_TYPE,
-    DOUBLE_TYPE,
-} NUM_TYPE;
+typedef RET_VAL (*BUILTIN_KERNEL)(CILISP_CONTEXT *ctx, RET_VAL *ops, int count);
 
+// How a builtin's result type follows from its operands' (see builtins.txt)
+typedef enum result_rule {
+    DOUBLE_RESULT,
+    PROMOTED_RESULT,
+    OPERAND_RESULT
+} RESULT_RULE;
 
+// An entry of the builtins table generated from builtins.txt
 typedef struct {
-    NUM_TYPE type;
-    double value;
-} AST_NUMBER;
+    const char *name;
+    BUILTIN_KERNEL apply;
+    BUILTIN_KERNEL applyInt;    // for operands that are all INT_TYPE; may be NULL
+    BUILTIN_KERNEL applyDouble; // same for DOUBLE_TYPE
+    int minOps; // operand counts it takes, checked by createFunctionNode;
+    int maxOps; // maxOps is -1 for no limit
+    RET_VAL fallback; // what a call with fewer than minOps operands gives
+    RESULT_RULE result;
+} BUILTIN;
 
-typedef AST_NUMBER RET_VAL;
+extern const BUILTIN builtins[FUNC_COUNT];
 
 
-typedef struct ast_function {
-    FUNC_TYPE func;
-    struct ast_node *opList;
-} AST_FUNCTION;
+// Nodes refer to each other by their index in tree.nodes
+typedef uint32_t NODE_INDEX;
+#define NO_NODE 0 // tree.nodes[0] is never used
 
+// depth, slot and definition are filled in by resolveSymbols. depth is the
+// nesting depth of the scope defining the symbol, -1 if it's undefined.
 typedef struct {
-    char *id;
+    char *id; // interned, see internSymbol
+    int depth;
+    int slot;
+    struct symbol_table_node *definition;
 } AST_SYMBOL;
 
 typedef struct {
-    struct ast_node *child;
+    struct symbol_table_node *symbolTable;
+    int depth;     // nesting depth of the definitions in symbolTable
+    int slotCount; // number of definitions in symbolTable
 } AST_SCOPE;
 
 
@@ -84,34 +98,267 @@ typedef enum ast_node_type {
     SCOPE_NODE_TYPE
 } AST_NODE_TYPE;
 
+// 16 bytes, so four nodes share a cache line. What doesn't fit is kept out
+// of line in tree.symbols and tree.scopes.
 typedef struct ast_node {
-    AST_NODE_TYPE type;
-    struct ast_node *parent;
-    struct symbol_table_node *symbolTable;
+    uint8_t type;       // AST_NODE_TYPE
+    uint8_t subtype;    // NUM_TYPE of a number, FUNC_TYPE of a function
+    uint8_t numType;    // NUM_TYPE of the node's value, see inferTypes
+    uint8_t kernelType; // functions: NUM_TYPE of the specialized kernel to call
+    NODE_INDEX parent;
     union {
-        AST_NUMBER number;
-        AST_FUNCTION function;
-        AST_SYMBOL symbol;
-        AST_SCOPE scope;
+        int64_t integer; // numbers, by subtype
+        double number;
+        struct {
+            uint32_t first; // operands are tree.operands[first] onwards
+            uint32_t count;
+        } function;
+        struct {
+            uint32_t index; // into tree.symbols
+        } symbol;
+        struct {
+            NODE_INDEX child;
+            uint32_t index; // into tree.scopes
+        } scope;
     } data;
-    struct ast_node *next;
 } AST_NODE;
 
+_Static_assert(sizeof(AST_NODE) == 16, "AST_NODE should stay 16 bytes");
+_Static_assert(CUSTOM_FUNC <= UINT8_MAX, "FUNC_TYPE must fit in AST_NODE.subtype");
+
+// The expression being parsed and evaluated, emptied by clearAst
+typedef struct {
+    AST_NODE *nodes;
+    int nodeCount, nodeCap;
+    NODE_INDEX *operands; // each function's operands, in order
+    int operandCount, operandCap;
+    AST_SYMBOL *symbols;
+    int symbolCount, symbolCap;
+    AST_SCOPE *scopes;
+    int scopeCount, scopeCap;
+} AST;
+
+typedef enum binding_state {
+    UNEVALUATED,
+    EVALUATING,
+    EVALUATED
+} BINDING_STATE;
+
 typedef struct symbol_table_node { 
-    char *id; 
-    struct ast_node *value;
+    char *id; // interned, see internSymbol
+    NODE_INDEX value;
+    int slot; // position in its symbol table, see resolveSymbols
+    int binding; // 1 + index of its BINDING in the chunk being compiled, 0 if none yet
+    NUM_TYPE type;           // of value, once inferTypes has typeState EVALUATED
+    BINDING_STATE typeState;
     struct symbol_table_node *next;
 } SYMBOL_TABLE_NODE;
 
-AST_NODE *createNumberNode(double value, NUM_TYPE type);
-AST_NODE *createFunctionNode(FUNC_TYPE func, AST_NODE *opList);
-AST_NODE *addExpressionToList(AST_NODE *newExpr, AST_NODE *exprList);
+// Bytecode instructions. Expressions are compiled to a CHUNK and run on
+// a stack of RET_VALs by runChunk (see vm.c)
+typedef enum op_code {
+    NUM_OP,     // push constants[a]
+    LOAD_OP,    // push bindings[a], running its code first if not yet evaluated;
+                // b is how many nodes the tree walker would be evaluating there
+    CALL_OP,    // pop b operands and push kernel applied to them
+    RETURN_OP   // end of the expression or of a binding's code
+} OP_CODE;
+
+typedef struct {
+    OP_CODE op;
+    int a;
+    int b;
+    BUILTIN_KERNEL kernel; // CALL_OP: builtin a's kernel, picked once by compileNode
+} INSTRUCTION;
+
+// A let definition referenced by the compiled code. Its value is computed
+// the first time it's loaded and reused afterwards, like the tree walker does.
+typedef struct {
+    SYMBOL_TABLE_NODE *sym; // only used while compiling
+    char *id;               // sym->id, still there once the AST is gone
+    int entry;
+    int frames;             // most nodes the tree walker evaluates at once in sym->value
+    BINDING_STATE state;
+    RET_VAL value;
+} BINDING;
+
+// A symbol with no let definition. It's compiled to a constant, which is
+// NAN unless cilisp_bind sets it.
+typedef struct {
+    char *name; // interned
+    int constant;
+} FREE_VARIABLE;
+
+// An entry of the compiler's hash of free variable names, which are interned
+// and so hashed and compared by pointer. Entries are only live in the chunk
+// whose stamp they carry (see addFreeVariable).
+typedef struct {
+    char *name;
+    int constant;
+    unsigned stamp;
+} FREE_VARIABLE_SLOT;
+
+// A let value computed by the tree walker, one per slot of each scope
+// being evaluated (see enterScope)
+typedef struct {
+    SYMBOL_TABLE_NODE *sym;
+    BINDING_STATE state;
+    RET_VAL value;
+} LET_VALUE;
+
+// A node the tree walker is evaluating (see stepEval). step counts a
+// function's operands evaluated so far; symbols and scopes set it to 1
+// once their value is being computed. base is where a function's operands
+// start on the value stack, or the letValues index of a symbol's slot (of
+// a scope's first slot).
+typedef struct {
+    NODE_INDEX node;
+    int step;
+    int base;
+    int savedBase; // scopes: the frameBase entry to put back
+} EVAL_FRAME;
+
+// A node resolveSymbols has still to resolve
+typedef struct {
+    NODE_INDEX node;
+    int depth;
+} RESOLVE_ITEM;
+
+// A node compileNode is in the middle of. next counts the operands (or the
+// scope's child) already compiled.
+typedef struct {
+    NODE_INDEX node;
+    int next;
+} COMPILE_FRAME;
+
+typedef struct {
+    int returnPc;
+    int binding;
+    int walkerFrames; // the tree walker's frames below the binding's code
+} FRAME;
+
+typedef struct {
+    INSTRUCTION *code;
+    int codeCount, codeCap;
+    RET_VAL *constants;
+    int constantCount, constantCap;
+    BINDING *bindings;
+    int bindingCount, bindingCap;
+    FREE_VARIABLE *freeVariables;
+    int freeVariableCount, freeVariableCap;
+    RET_VAL *stack;  // sized at compile time, see compileChunk
+    int stackMax;
+    FRAME *frames;   // one per binding being evaluated
+} CHUNK;
+
+// The blocks of memory arenaAlloc hands out pieces of (see arena.c)
+typedef struct {
+    struct arena_block *first;
+    struct arena_block *current;
+} ARENA;
+
+/*
+ * An interpreter: its options, where its output goes, the scanner and
+ * parser state, the expression being evaluated and every buffer the
+ * evaluators keep between calls. Nothing in cilisp is global, so separate
+ * contexts can be used from separate threads at the same time; one
+ * context must only be used by one thread at a time.
+ */
+struct cilisp_context {
+    bool batchMode; // --batch: whole input scanned and parsed in one pass
+    int jobs;       // --jobs N: lines evaluated on N threads, see jobs.c
+    bool vm;        // --vm: compile each expression to bytecode and run that, instead of walking the AST
+    int maxDepth;   // --max-depth=N: deepest nesting evaluated before giving up with a warning
+
+    FILE *out;        // results and warnings
+    FILE *readTarget;
+    FILE *log;
+    void *scanner;    // the flex scanner (a yyscan_t) feeding yyparse
+
+    // Set by cilisp_compile: the parser keeps the program in program instead
+    // of evaluating it, refusing a second one or quit, and undefined symbols
+    // are free variables rather than errors
+    bool compiling;
+    NODE_INDEX program;
+
+    // Set by cilisp_compile and the --jobs workers: quit, the end of the
+    // input and parse errors only stop the parse, setting ended or error,
+    // instead of ending the process
+    bool keepRunning;
+    bool ended;
+    char *error;
+    void *parseStack; // yyparse's stack once it's outgrown its frame, see YYMALLOC
+
+    AST tree;
+    ARENA arena;
+    NODE_INDEX *pendingOperands; // of the function calls still being parsed, innermost call's last
+    int pendingCount, pendingCap;
+
+    char **internTable; // see internSymbol
+    size_t internCap, internCount;
+
+    SYMBOL_TABLE_NODE **scopeChain; // resolveSymbols: scopeChain[d] is the symbol table at depth d
+    int scopeChainCap;
+    RESOLVE_ITEM *resolveStack;
+    int resolveCount, resolveCap;
+
+    LET_VALUE *letValues; // the tree walker's, see enterScope
+    int letValueCount, letValueCap;
+    int *frameBase;
+    int frameBaseCap;
+    EVAL_FRAME *evalFrames;
+    int evalFrameCount, evalFrameCap;
+    RET_VAL *evalValues;
+    int evalValueCount, evalValueCap;
+
+    COMPILE_FRAME *compileFrames; // see compileNode
+    int compileFrameCount, compileFrameCap;
+    FREE_VARIABLE_SLOT *freeVariableSlots; // see addFreeVariable
+    int freeVariableSlotCap;
+    unsigned compileStamp;
+};
+
+CILISP_CONTEXT *createContext(FILE *out);
+void freeContext(CILISP_CONTEXT *ctx);
+
+void *growArray(void *array, int count, int *cap, size_t elemSize);
+
+NODE_INDEX createNumberNode(CILISP_CONTEXT *ctx, RET_VAL value);
+NODE_INDEX createFunctionNode(CILISP_CONTEXT *ctx, FUNC_TYPE func, int list);
+NODE_INDEX createSymbolNode(CILISP_CONTEXT *ctx, char *name);
+NODE_INDEX createScopeNode(CILISP_CONTEXT *ctx, SYMBOL_TABLE_NODE *symTable, NODE_INDEX s_expr);
+SYMBOL_TABLE_NODE *createSymbolTableNode(CILISP_CONTEXT *ctx, char *id, NODE_INDEX val);
+SYMBOL_TABLE_NODE *addSymbolToList(CILISP_CONTEXT *ctx, SYMBOL_TABLE_NODE *sym, SYMBOL_TABLE_NODE *symList);
+int startExpressionList(CILISP_CONTEXT *ctx);
+int addExpressionToList(CILISP_CONTEXT *ctx, NODE_INDEX newExpr, int list);
+void clearAst(CILISP_CONTEXT *ctx);
+
+RET_VAL eval(CILISP_CONTEXT *ctx, NODE_INDEX root);
+RET_VAL evalNumNode(AST_NODE *node);
+RET_VAL applyBuiltin(CILISP_CONTEXT *ctx, FUNC_TYPE func, RET_VAL *ops, int count);
+BUILTIN_KERNEL nodeKernel(AST_NODE *node);
+void resolveSymbols(CILISP_CONTEXT *ctx, NODE_INDEX root);
+void inferTypes(CILISP_CONTEXT *ctx, NODE_INDEX root);
+
+double toDouble(RET_VAL val);
+
+double sumOperands(RET_VAL *ops, int count);
+double multiplyOperands(RET_VAL *ops, int count);
+double sumSquaredOperands(RET_VAL *ops, int count);
+int maxOperand(RET_VAL *ops, int count);
+int minOperand(RET_VAL *ops, int count);
+bool sumIntOperands(RET_VAL *ops, int count, int64_t *sum);
+bool multiplyIntOperands(RET_VAL *ops, int count, int64_t *product);
 
-RET_VAL eval(AST_NODE *node);
+CHUNK *compileChunk(CILISP_CONTEXT *ctx, NODE_INDEX root);
+RET_VAL runChunk(CILISP_CONTEXT *ctx, CHUNK *chunk);
+void freeChunk(CHUNK *chunk);
 
-void printRetVal(RET_VAL val);
+void printRetVal(CILISP_CONTEXT *ctx, RET_VAL val);
 
-void freeNode(AST_NODE *node);
+void *arenaAlloc(ARENA *arena, size_t size);
+void arenaReset(ARENA *arena);
+void arenaFree(ARENA *arena);
 
 #endif
 
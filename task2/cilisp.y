@@ -2,53 +2,106 @@
     #include "cilisp.h"
     //#define ylog(r, p, t) {printf("BISON: %s ::= %s (%p)\n", #r, #p, t);}
     #define ylog(r, p, t) {}
-    int yylex();
-    void yyerror(char*, ...);
+    // Line mode parses one program per yyparse call; batch mode parses
+    // the whole script in one call, so programs only accept in line mode.
+    #define YYACCEPT_LINE() { if (!ctx->batchMode) YYACCEPT; }
+    // quit and the end of the input end the session, or only the parse
+    // if ctx->keepRunning
+    #define YYEXIT() { if (ctx->keepRunning) { ctx->ended = true; YYACCEPT; } exit(EXIT_SUCCESS); }
+    // Let the parser stack grow (on the heap) well past ctx->maxDepth levels
+    // of nesting, so it's the evaluators that give up on deep expressions,
+    // with a warning, rather than the parser
+    #define YYMAXDEPTH (4L * (ctx->maxDepth > DEFAULT_MAX_DEPTH ? ctx->maxDepth : DEFAULT_MAX_DEPTH) + 10000)
+    // The heap-grown stack is kept in ctx->parseStack, for whoever catches a
+    // yyerror longjmp out of yyparse (see ERROR_TRAP) to free
+    #define YYMALLOC(size) (ctx->parseStack = malloc(size))
+    #define YYFREE(stack) (ctx->parseStack = ctx->parseStack == (stack) ? NULL : ctx->parseStack, free(stack))
+    // The parser calls yyerror with its parameters; see parseError
+    #define yyerror(scanner, ctx, message) parseError(ctx, message)
 %}
 
+// Reentrant: the parser's state lives in yyparse's frame, and everything
+// else it touches comes in through ctx and the (reentrant) scanner
+%define api.pure full
+%param {void *scanner}
+%parse-param {CILISP_CONTEXT *ctx}
+
 %union {
     double dval;
+    long long lval; // INT literals, kept exact
     int ival;
     char *id;
-    struct ast_node *astNode;  // NOTE: AST_NODES hold either AST_NUMBER or AST_FUNCTION
-                               // in nodeptr->data.number/function
+    unsigned int astNode;      // NODE_INDEX of the node in tree.nodes
+    int list;                  // start of an operand list, see addExpressionToList
     struct symbol_table_node *symNode;
 };                             
 
+%{
+    int yylex(YYSTYPE *lvalp, void *scanner);
+%}
+
 %token <ival> FUNC
-%token <dval> INT DOUBLE
+%token <lval> INT
+%token <dval> DOUBLE
 %token <id> SYMBOL
 %token QUIT EOL EOFT LPAREN RPAREN LET
 
-%type <astNode> number s_expr f_expr s_expr_list s_expr_section  
+%type <astNode> number s_expr f_expr
+%type <list> s_expr_list s_expr_section
 %type <symNode> let_elem let_list let_section
 
 %%
 
+script:
+    program {
+        ylog(script, program, 0);
+    }
+    | script program {
+        ylog(script, script program, 0);
+    };
+
 program:
     s_expr EOL {
         ylog(program, s_expr EOL, 0);
-        if ($1) {
-            printRetVal(eval($1));
-            freeNode($1);
+        if ($1 && ctx->compiling) {
+            if (ctx->program != NO_NODE) {
+                parseError(ctx, "only one expression can be compiled");
+                YYABORT;
+            }
+            ctx->program = $1;
+        }
+        else if ($1) {
+            resolveSymbols(ctx, $1);
+            inferTypes(ctx, $1);
+            printRetVal(ctx, eval(ctx, $1));
+            clearAst(ctx);
         }
-        YYACCEPT;
+        YYACCEPT_LINE();
     }
     | s_expr EOFT {
         ylog(program, s_expr EOFT, 0);
-        if ($1) {
-            printRetVal(eval($1));
-            freeNode($1);
+        if ($1 && ctx->compiling) {
+            if (ctx->program != NO_NODE) {
+                parseError(ctx, "only one expression can be compiled");
+                YYABORT;
+            }
+            ctx->program = $1;
+        }
+        else if ($1) {
+            resolveSymbols(ctx, $1);
+            inferTypes(ctx, $1);
+            printRetVal(ctx, eval(ctx, $1));
+            clearAst(ctx);
         }
-        exit(EXIT_SUCCESS);
+        YYEXIT();
     }
     | EOL {
         ylog(program, EOL, 0);
-        YYACCEPT;  // paranoic; main skips blank lines
+        YYACCEPT_LINE();  // paranoic in line mode; main skips blank lines
     }
     | EOFT {
         ylog(program, EOFT, 0);
-        exit(EXIT_SUCCESS);
+        YYEXIT();
     };
 
 
@@ -63,26 +116,33 @@ s_expr:
     }
     | SYMBOL {
         ylog(s_expr, SYMBOL, $1);
-        $$ = createSymbolNode($1); 
+        $$ = createSymbolNode(ctx, $1); 
     }
     | LPAREN let_section s_expr RPAREN {
         ylog(s_expr, LPAREN let_section s_expr RPAREN, $2);
-        $$ = createScopeNode($2, $3);
+        $$ = createScopeNode(ctx, $2, $3);
     }
     | QUIT {
         ylog(s_expr, QUIT, 0);
-        exit(EXIT_SUCCESS);
+        if (ctx->compiling) {
+            parseError(ctx, "quit can't be compiled");
+            YYABORT;
+        }
+        YYEXIT();
     }
     | error {
         ylog(s_expr, error, 0);
-        yyerror("unexpected token");
-        $$ = NULL;
+        if (ctx->keepRunning) {
+            YYABORT; // at the first error, already in ctx->error
+        }
+        yyerror(scanner, ctx, "unexpected token");
+        $$ = NO_NODE;
     };
 
 f_expr:
     LPAREN FUNC s_expr_section RPAREN {
         ylog(f_expr, LPAREN  FUNC s_expr_section RPAREN, $3);
-        $$ = createFunctionNode($2, $3);
+        $$ = createFunctionNode(ctx, $2, $3);
     };
 
 s_expr_section:
@@ -90,7 +150,7 @@ s_expr_section:
         ylog(s_expr_section, s_expr_list, $1);
         $$ = $1;
     }
-    |   { ylog(s_expr_section, <empty>, 0); $$ = NULL; };  
+    |   { ylog(s_expr_section, <empty>, 0); $$ = startExpressionList(ctx); };  
 
 let_section:
     LPAREN LET let_list RPAREN {
@@ -102,12 +162,13 @@ let_section:
 s_expr_list:
     s_expr {
         ylog(s_expr_list, s_expr, $1);
-        $$ = $1;
+        $$ = addExpressionToList(ctx, $1, startExpressionList(ctx));
     }
-    | s_expr s_expr_list {
-        ylog(s_expr_list, s_expr s_expr_list, $1);
-        // Add new s_expr to list
-        $$ = addExpressionToList($1, $2);
+    | s_expr_list s_expr {
+        ylog(s_expr_list, s_expr_list s_expr, $2);
+        // Add new s_expr to list. Left recursive so long operand lists don't
+        // overflow the parser stack.
+        $$ = addExpressionToList(ctx, $2, $1);
     };
                         // Creates a symbol table list
 let_list:
@@ -117,25 +178,27 @@ let_list:
     }
     | let_elem let_list {
         ylog(let_list, let_elem let_list, 0);
-        $$ = addSymbolToList($1, $2);
+        $$ = addSymbolToList(ctx, $1, $2);
     };
 
 
 let_elem:       
     LPAREN SYMBOL s_expr RPAREN {                           // TODO: What if the same symbol is defined twice
         ylog(let_elem, LPAREN SYMBOL s_expr RPAREN, $3); 
-        $$ = createSymbolTableNode($2, $3);
+        $$ = createSymbolTableNode(ctx, $2, $3);
     };
 
 number: 
     INT {
         ylog(number, INT, 0);
-        $$ = createNumberNode($1, INT_TYPE);
+        $$ = createNumberNode(ctx, INT_RET_VAL($1));
     }
     |
     DOUBLE {
         ylog(number, DOUBLE, 0);
-        $$ = createNumberNode($1, DOUBLE_TYPE);
+        $$ = createNumberNode(ctx, DOUBLE_RET_VAL($1));
     };
 %%
 
+// Only the parser's own yyerror calls go to parseError
+#undef yyerror
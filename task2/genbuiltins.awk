@@ -0,0 +1,151 @@
+# Generates builtins.h and builtins.c from the builtins.txt registry:
+#     awk -f genbuiltins.awk builtins.txt
+#
+# resolveFunc hashes a name with h = (h * 33 + c) % HASH_MOD starting from
+# a seed, then indexes builtinSlots with h % size. The smallest table size
+# (and first seed for it) with no two builtins in the same slot is picked
+# here, so a lookup is one hash and at most one strcmp.
+
+BEGIN {
+    HASH_MOD = 1048573
+    n = 0
+    for (i = 1; i < 256; i++) {
+        ord[sprintf("%c", i)] = i
+    }
+}
+
+/^#/ || NF == 0 { next }
+
+NF != 9 {
+    printf("builtins.txt:%d: expected name, enum, kernel, int, double, min, max, fallback and result\n", NR) > "/dev/stderr"
+    failed = 1
+    exit 1
+}
+
+{
+    name[n] = $1
+    enumName[n] = $2
+    kernel[n] = $3
+    intKernel[n] = $4
+    doubleKernel[n] = $5
+    minOps[n] = $6
+    maxOps[n] = $7
+    fallback[n] = $8
+    result[n] = toupper($9) "_RESULT"
+    n++
+}
+
+function hash(s, seed,    h, i) {
+    h = seed
+    for (i = 1; i <= length(s); i++) {
+        h = (h * 33 + ord[substr(s, i, 1)]) % HASH_MOD
+    }
+    return h
+}
+
+function orNull(kernel) {
+    return kernel == "-" ? "NULL" : kernel
+}
+
+# A RET_VAL initializer for a fallback value
+function retVal(value) {
+    if (value == "nan") {
+        return "{DOUBLE_TYPE, .dval = NAN}"
+    }
+    return index(value, ".") ? "{DOUBLE_TYPE, .dval = " value "}" : "{INT_TYPE, .ival = " value "}"
+}
+
+# 1 if every builtin gets its own slot; fills slot[] with their indexes
+function placeAll(size, seed,    i, h) {
+    split("", slot)
+    for (i = 0; i < n; i++) {
+        h = hash(name[i], seed) % size
+        if (h in slot) {
+            return 0
+        }
+        slot[h] = i
+    }
+    return 1
+}
+
+END {
+    if (failed) {
+        exit 1
+    }
+
+    for (size = n; ; size++) {
+        for (seed = 0; seed < 256; seed++) {
+            if (placeAll(size, seed)) {
+                break
+            }
+        }
+        if (seed < 256) {
+            break
+        }
+    }
+
+    h = "builtins.h"
+    print "// Generated by genbuiltins.awk from builtins.txt. Do not edit." > h
+    print "#ifndef __builtins_h_" > h
+    print "#define __builtins_h_" > h
+    print "" > h
+    print "typedef enum func_type {" > h
+    for (i = 0; i < n; i++) {
+        print "    " enumName[i] "," > h
+    }
+    print "    CUSTOM_FUNC" > h
+    print "} FUNC_TYPE;" > h
+    print "" > h
+    print "#define FUNC_COUNT " n " // builtins, not counting CUSTOM_FUNC" > h
+    print "" > h
+    print "#endif" > h
+
+    c = "builtins.c"
+    print "// Generated by genbuiltins.awk from builtins.txt. Do not edit." > c
+    print "#include \"cilisp.h\"" > c
+    print "" > c
+    print "#define BUILTIN_HASH_SEED " seed > c
+    print "#define BUILTIN_HASH_MOD " HASH_MOD > c
+    print "#define BUILTIN_HASH_SIZE " size > c
+    print "" > c
+    for (i = 0; i < n; i++) {
+        print "RET_VAL " kernel[i] "(CILISP_CONTEXT *ctx, RET_VAL *ops, int count);" > c
+        if (intKernel[i] != "-") {
+            print "RET_VAL " intKernel[i] "(CILISP_CONTEXT *ctx, RET_VAL *ops, int count);" > c
+        }
+        if (doubleKernel[i] != "-") {
+            print "RET_VAL " doubleKernel[i] "(CILISP_CONTEXT *ctx, RET_VAL *ops, int count);" > c
+        }
+    }
+    print "" > c
+    print "const BUILTIN builtins[FUNC_COUNT] = {" > c
+    for (i = 0; i < n; i++) {
+        printf("    [%s] = {\"%s\", %s, %s, %s, %d, %d, %s, %s},\n", enumName[i], name[i], kernel[i],
+               orNull(intKernel[i]), orNull(doubleKernel[i]), minOps[i], maxOps[i], retVal(fallback[i]), result[i]) > c
+    }
+    print "};" > c
+    print "" > c
+    print "// FUNC_TYPE of the builtin hashing to each slot, -1 for none" > c
+    print "static const signed char builtinSlots[BUILTIN_HASH_SIZE] = {" > c
+    for (i = 0; i < size; i++) {
+        print "    " ((i in slot) ? enumName[slot[i]] : "-1") "," > c
+    }
+    print "};" > c
+    print "" > c
+    print "// The builtin called name, CUSTOM_FUNC if there's none" > c
+    print "FUNC_TYPE resolveFunc(const char *name)" > c
+    print "{" > c
+    print "    unsigned long h = BUILTIN_HASH_SEED;" > c
+    print "" > c
+    print "    for (const unsigned char *c = (const unsigned char *) name; *c != '\\0'; c++) {" > c
+    print "        h = (h * 33 + *c) % BUILTIN_HASH_MOD;" > c
+    print "    }" > c
+    print "" > c
+    print "    int func = builtinSlots[h % BUILTIN_HASH_SIZE];" > c
+    print "    if (func < 0 || strcmp(builtins[func].name, name) != 0) {" > c
+    print "        return CUSTOM_FUNC;" > c
+    print "    }" > c
+    print "" > c
+    print "    return func;" > c
+    print "}" > c
+}
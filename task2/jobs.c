@@ -0,0 +1,300 @@
+#include <pthread.h>
+#include "cilisp.h"
+
+/*
+ * --jobs N: runs the lines of a script on N threads, each with a
+ * CILISP_CONTEXT of its own, and prints what each line printed in the
+ * script's order. Programs end at the end of their line, and every builtin
+ * is pure (see isPureBuiltin), so no line can change what another prints
+ * and the output is the same as --batch's.
+ *
+ * Lines are handed out a block of JOBS_BLOCK_LINES at a time. A line's
+ * output goes to a memory stream and waits there until the main thread has
+ * printed the lines before it; workers stay at most JOBS_WINDOW blocks
+ * ahead of the printing, so that wait doesn't grow with the script. A quit
+ * or a parse error ends the output at its line, as it ends --batch, however
+ * far past it the workers have got.
+ *
+ * No worker exits the process: that would cut short what the others are
+ * writing. A yyerror in a worker (memory running out) comes back to it
+ * (see ERROR_TRAP) and ends the script at its line like a parse error. A
+ * worker or thread that can't start leaves the lines to the others. Either
+ * way, the main thread reports the error once every worker is done.
+ */
+
+#define JOBS_BLOCK_LINES 64
+#define JOBS_WINDOW(jobs) (4 * (jobs))
+
+typedef struct {
+    char *output; // everything the line printed
+    size_t length;
+    char *error;  // the parse error (or failure) the script ends with here, NULL if none
+    bool ended;   // quit, or the end of the input
+} JOB_LINE;
+
+// What the workers and the main thread share. lock guards nextBlock,
+// printedBlocks, blockDone, stop, running and failure.
+typedef struct {
+    CILISP_CONTEXT *options; // whose options the workers' contexts copy
+    char **lines;            // line i is lines[i] up to lines[i + 1], newline included
+    int lineCount;
+    int blockCount;
+    int window;              // blocks
+    JOB_LINE *results;       // the window's lines; block b's are at (b % window) * JOBS_BLOCK_LINES
+    bool *blockDone;         // by window slot too
+    int nextBlock;
+    int printedBlocks;
+    bool stop;
+    int running;             // workers that haven't returned
+    char failure[256];       // the first yyerror a worker hit, or a thread that couldn't start
+    pthread_mutex_t lock;
+    pthread_cond_t blockFinished;  // the main thread waits on this
+    pthread_cond_t windowMoved;    // and the workers on this
+} JOBS;
+
+// Keeps the first failure, for the main thread to report, and returns it
+static char *recordFailure(JOBS *jobs, char *message)
+{
+    pthread_mutex_lock(&jobs->lock);
+    if (jobs->failure[0] == '\0') {
+        snprintf(jobs->failure, sizeof(jobs->failure), "%s", message);
+    }
+    pthread_mutex_unlock(&jobs->lock);
+
+    return jobs->failure;
+}
+
+// Parses and evaluates one line, keeping what it printed in result. A
+// yyerror ends the script at this line, like a parse error.
+static void runLine(JOBS *jobs, CILISP_CONTEXT *ctx, char *text, size_t length, JOB_LINE *result)
+{
+    ERROR_TRAP trap;
+    volatile YY_BUFFER_STATE buffer = NULL;
+
+    result->output = NULL;
+    result->length = 0;
+    ctx->out = NULL;
+    ctx->ended = false;
+    ctx->error = NULL;
+
+    if (setjmp(trap.jump) != 0) {
+        ctx->error = recordFailure(jobs, trap.message);
+        free(ctx->parseStack); // left behind if the longjmp came out of yyparse
+        ctx->parseStack = NULL;
+    }
+    else {
+        errorTrap = &trap;
+        if ((ctx->out = open_memstream(&result->output, &result->length)) == NULL) {
+            yyerror("Memory allocation failed!");
+        }
+        buffer = yy_scan_bytes(text, length, ctx->scanner);
+        yyparse(ctx->scanner, ctx);
+    }
+    errorTrap = NULL;
+
+    if (buffer != NULL) {
+        yy_delete_buffer(buffer, ctx->scanner);
+    }
+    clearAst(ctx); // what's left of a program the parser gave up on
+    if (ctx->out != NULL) {
+        fclose(ctx->out);
+    }
+
+    result->error = ctx->error;
+    result->ended = ctx->ended;
+}
+
+// The worker's context, NULL (with the failure recorded) if it can't have one
+static CILISP_CONTEXT *startWorker(JOBS *jobs)
+{
+    ERROR_TRAP trap;
+    CILISP_CONTEXT *volatile ctx = NULL;
+
+    if (setjmp(trap.jump) != 0) {
+        errorTrap = NULL;
+        recordFailure(jobs, trap.message);
+        freeContext(ctx);
+        return NULL;
+    }
+    errorTrap = &trap;
+
+    ctx = createContext(NULL);
+    ctx->vm = jobs->options->vm;
+    ctx->maxDepth = jobs->options->maxDepth;
+    ctx->readTarget = jobs->options->readTarget;
+    ctx->keepRunning = true;
+    if (yylex_init_extra(ctx, &ctx->scanner) != 0) {
+        yyerror("Memory allocation failed!");
+    }
+
+    errorTrap = NULL;
+    return ctx;
+}
+
+static void *jobWorker(void *arg)
+{
+    JOBS *jobs = arg;
+    CILISP_CONTEXT *ctx = startWorker(jobs);
+
+    while (ctx != NULL) {
+        pthread_mutex_lock(&jobs->lock);
+        while (!jobs->stop && jobs->nextBlock < jobs->blockCount &&
+               jobs->nextBlock - jobs->printedBlocks >= jobs->window) {
+            pthread_cond_wait(&jobs->windowMoved, &jobs->lock);
+        }
+        if (jobs->stop || jobs->nextBlock >= jobs->blockCount) {
+            pthread_mutex_unlock(&jobs->lock);
+            break;
+        }
+        int block = jobs->nextBlock++;
+        pthread_mutex_unlock(&jobs->lock);
+
+        JOB_LINE *results = jobs->results + (block % jobs->window) * JOBS_BLOCK_LINES;
+        int first = block * JOBS_BLOCK_LINES;
+        for (int i = first; i < first + JOBS_BLOCK_LINES && i < jobs->lineCount; i++) {
+            runLine(jobs, ctx, jobs->lines[i], jobs->lines[i + 1] - jobs->lines[i], &results[i - first]);
+        }
+
+        pthread_mutex_lock(&jobs->lock);
+        jobs->blockDone[block % jobs->window] = true;
+        pthread_cond_signal(&jobs->blockFinished);
+        pthread_mutex_unlock(&jobs->lock);
+    }
+
+    if (ctx != NULL) {
+        yylex_destroy(ctx->scanner);
+        freeContext(ctx);
+    }
+
+    // The main thread stops waiting for blocks once no worker is left
+    pthread_mutex_lock(&jobs->lock);
+    jobs->running--;
+    pthread_cond_signal(&jobs->blockFinished);
+    pthread_mutex_unlock(&jobs->lock);
+
+    return NULL;
+}
+
+// Prints the block's lines in order, freeing their output. false if the
+// script ends in it, with *error set if a parse error ends it.
+static bool printBlock(JOBS *jobs, int block, char **error)
+{
+    JOB_LINE *results = jobs->results + (block % jobs->window) * JOBS_BLOCK_LINES;
+    int count = jobs->lineCount - block * JOBS_BLOCK_LINES;
+    bool ended = false;
+
+    if (count > JOBS_BLOCK_LINES) {
+        count = JOBS_BLOCK_LINES;
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (!ended) {
+            fwrite(results[i].output, 1, results[i].length, jobs->options->out);
+            *error = results[i].error;
+            ended = results[i].ended || *error != NULL;
+        }
+        free(results[i].output);
+    }
+
+    return !ended;
+}
+
+// Runs the script text, length bytes of lines, on ctx->jobs threads
+void runJobs(CILISP_CONTEXT *ctx, char *text, size_t length)
+{
+    JOBS jobs = {.options = ctx};
+    int lineCap = 0;
+    char *end = text + length;
+
+    for (char *line = text; line < end; ) {
+        char *newline = memchr(line, '\n', end - line);
+        jobs.lines = growArray(jobs.lines, jobs.lineCount, &lineCap, sizeof(char *));
+        jobs.lines[jobs.lineCount++] = line;
+        line = newline != NULL ? newline + 1 : end;
+    }
+    jobs.lines = growArray(jobs.lines, jobs.lineCount, &lineCap, sizeof(char *));
+    jobs.lines[jobs.lineCount] = end;
+
+    jobs.blockCount = (jobs.lineCount + JOBS_BLOCK_LINES - 1) / JOBS_BLOCK_LINES;
+    jobs.window = JOBS_WINDOW(ctx->jobs);
+    jobs.results = calloc(jobs.window * JOBS_BLOCK_LINES, sizeof(JOB_LINE));
+    jobs.blockDone = calloc(jobs.window, sizeof(bool));
+    pthread_t *workers = malloc(sizeof(pthread_t) * ctx->jobs);
+    if (jobs.results == NULL || jobs.blockDone == NULL || workers == NULL) {
+        yyerror("Memory allocation failed!");
+    }
+    pthread_mutex_init(&jobs.lock, NULL);
+    pthread_cond_init(&jobs.blockFinished, NULL);
+    pthread_cond_init(&jobs.windowMoved, NULL);
+
+    // The threads that did start run the script without the rest
+    int started = 0;
+    jobs.running = ctx->jobs;
+    while (started < ctx->jobs) {
+        if (pthread_create(&workers[started], NULL, jobWorker, &jobs) != 0) {
+            char message[64];
+            snprintf(message, sizeof(message), "Couldn't start --jobs thread %d", started + 1);
+            recordFailure(&jobs, message);
+
+            pthread_mutex_lock(&jobs.lock);
+            jobs.running -= ctx->jobs - started;
+            pthread_mutex_unlock(&jobs.lock);
+            break;
+        }
+        started++;
+    }
+
+    bool more = true;
+    char *error = NULL;
+    for (int block = 0; block < jobs.blockCount && more; block++) {
+        pthread_mutex_lock(&jobs.lock);
+        while (!jobs.blockDone[block % jobs.window] && jobs.running > 0) {
+            pthread_cond_wait(&jobs.blockFinished, &jobs.lock);
+        }
+        bool done = jobs.blockDone[block % jobs.window];
+        pthread_mutex_unlock(&jobs.lock);
+
+        if (!done) {
+            break; // every worker failed to start
+        }
+
+        more = printBlock(&jobs, block, &error);
+
+        pthread_mutex_lock(&jobs.lock);
+        jobs.blockDone[block % jobs.window] = false;
+        jobs.printedBlocks++;
+        jobs.stop = !more;
+        pthread_cond_broadcast(&jobs.windowMoved);
+        pthread_mutex_unlock(&jobs.lock);
+    }
+    fflush(ctx->out);
+
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    // Blocks finished past the end of the script were never printed
+    for (int block = jobs.printedBlocks; block < jobs.nextBlock; block++) {
+        JOB_LINE *results = jobs.results + (block % jobs.window) * JOBS_BLOCK_LINES;
+        for (int i = 0; i < JOBS_BLOCK_LINES && block * JOBS_BLOCK_LINES + i < jobs.lineCount; i++) {
+            free(results[i].output);
+        }
+    }
+
+    pthread_cond_destroy(&jobs.windowMoved);
+    pthread_cond_destroy(&jobs.blockFinished);
+    pthread_mutex_destroy(&jobs.lock);
+    free(workers);
+    free(jobs.blockDone);
+    free(jobs.results);
+    free(jobs.lines);
+
+    // A worker that couldn't start or carry on ends the run with an error,
+    // even when the others got through the script without it
+    if (error == NULL && jobs.failure[0] != '\0') {
+        error = jobs.failure;
+    }
+    if (error != NULL) {
+        yyerror("%s", error);
+    }
+}
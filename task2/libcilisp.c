@@ -0,0 +1,189 @@
+#include "cilisp.h"
+
+/*
+ * libcilisp: the interpreter as a library, for programs that evaluate the
+ * same expressions over and over. cilisp_compile parses and compiles an
+ * expression once; cilisp_exec then runs its bytecode, with no parsing,
+ * no printing and no process to start. Symbols the expression doesn't
+ * define with let are its free variables, NAN until cilisp_bind sets them.
+ *
+ *     CILISP_CONTEXT *ctx = cilisp_open(stderr);
+ *     CILISP_HANDLE *handle = cilisp_compile(ctx, "(add (mult x x) 1)");
+ *     RET_VAL ret;
+ *
+ *     cilisp_bind(handle, "x", INT_RET_VAL(3));
+ *     cilisp_exec(handle, &ret); // ret is the integer 10
+ *
+ *     cilisp_free(handle);
+ *     cilisp_close(ctx);
+ *
+ * run builds it as libcilisp.so, which exports only what libcilisp.h
+ * declares. Warnings go to the stream given to cilisp_open, and no call
+ * ends the host's process: where the interpreter would exit (running out
+ * of memory), yyerror jumps back to the call, which fails instead (see
+ * ERROR_TRAP). Running a compiled expression allocates nothing, so
+ * cilisp_exec can't fail that way. A handle can be compiled, bound and run
+ * while its context compiles others, but mustn't outlive it, and like the
+ * context it must only be used by one thread at a time.
+ */
+
+struct cilisp_handle {
+    CILISP_CONTEXT *ctx;
+    CHUNK *chunk;
+};
+
+// A context with its own scanner, writing warnings to out. NULL if memory
+// runs out.
+CILISP_CONTEXT *cilisp_open(FILE *out)
+{
+    ERROR_TRAP trap;
+    CILISP_CONTEXT *volatile ctx = NULL;
+
+    if (setjmp(trap.jump) != 0) {
+        errorTrap = NULL;
+        freeContext(ctx);
+        return NULL;
+    }
+    errorTrap = &trap;
+
+    ctx = createContext(out);
+    if (yylex_init_extra(ctx, &ctx->scanner) != 0) {
+        yyerror("Memory allocation failed!");
+    }
+
+    errorTrap = NULL;
+    return ctx;
+}
+
+void cilisp_close(CILISP_CONTEXT *ctx)
+{
+    if (!ctx) {
+        return;
+    }
+
+    yylex_destroy(ctx->scanner);
+    freeContext(ctx);
+}
+
+// The compiled form of src, one expression. NULL, with a warning, if src
+// doesn't parse, holds more than the one expression, nests too deep or
+// runs out of memory.
+CILISP_HANDLE *cilisp_compile(CILISP_CONTEXT *ctx, const char *src)
+{
+    ERROR_TRAP trap;
+    size_t len = strlen(src);
+    char *volatile text = NULL;
+    volatile YY_BUFFER_STATE buffer = NULL;
+    CHUNK *volatile chunk = NULL;
+    CILISP_HANDLE *volatile handle = NULL;
+
+    // Batch mode parses all of src in one go, so the parser sees (and
+    // refuses) anything after the expression
+    ctx->compiling = true;
+    ctx->keepRunning = true;
+    ctx->batchMode = true;
+    ctx->error = NULL;
+    ctx->program = NO_NODE;
+
+    if (setjmp(trap.jump) != 0) {
+        warning(ctx, "%s", trap.message);
+        free(ctx->parseStack); // left behind if the longjmp came out of yyparse
+        ctx->parseStack = NULL;
+    }
+    else {
+        errorTrap = &trap;
+
+        if ((text = malloc(len + 3)) == NULL) {
+            yyerror("Memory allocation failed!");
+        }
+
+        // The grammar wants the expression to end its line, and
+        // yy_scan_buffer wants two '\0's after that
+        memcpy(text, src, len);
+        text[len] = '\n';
+        text[len + 1] = '\0';
+        text[len + 2] = '\0';
+
+        buffer = yy_scan_buffer(text, len + 3, ctx->scanner);
+        int failed = yyparse(ctx->scanner, ctx);
+
+        if (ctx->error != NULL) {
+            warning(ctx, "%s", ctx->error);
+        }
+        else if (failed != 0 || ctx->program == NO_NODE) {
+            warning(ctx, "No expression to compile");
+        }
+        else {
+            resolveSymbols(ctx, ctx->program);
+            inferTypes(ctx, ctx->program);
+            chunk = compileChunk(ctx, ctx->program);
+        }
+
+        if (chunk != NULL) {
+            if ((handle = malloc(sizeof(CILISP_HANDLE))) == NULL) {
+                yyerror("Memory allocation failed!");
+            }
+            handle->ctx = ctx;
+            handle->chunk = chunk;
+        }
+    }
+
+    errorTrap = NULL;
+    if (buffer != NULL) {
+        yy_delete_buffer(buffer, ctx->scanner);
+    }
+    free(text);
+    if (handle == NULL && chunk != NULL) {
+        freeChunk(chunk);
+    }
+
+    clearAst(ctx);
+    ctx->compiling = false;
+    ctx->keepRunning = false;
+    ctx->batchMode = false;
+
+    return handle;
+}
+
+// Gives free variable name value for the cilisp_execs that follow. -1 if
+// the expression has no free variable called name.
+int cilisp_bind(CILISP_HANDLE *handle, const char *name, RET_VAL value)
+{
+    if (!handle) {
+        return -1;
+    }
+
+    CHUNK *chunk = handle->chunk;
+
+    for (int i = 0; i < chunk->freeVariableCount; i++) {
+        if (strcmp(chunk->freeVariables[i].name, name) == 0) {
+            chunk->constants[chunk->freeVariables[i].constant] = value;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+// Evaluates the expression into *ret. -1 for a NULL handle, as
+// cilisp_compile returns for an expression it couldn't compile.
+int cilisp_exec(CILISP_HANDLE *handle, RET_VAL *ret)
+{
+    if (!handle) {
+        return -1;
+    }
+
+    *ret = runChunk(handle->ctx, handle->chunk);
+
+    return 0;
+}
+
+void cilisp_free(CILISP_HANDLE *handle)
+{
+    if (!handle) {
+        return;
+    }
+
+    freeChunk(handle->chunk);
+    free(handle);
+}
@@ -0,0 +1,54 @@
+#ifndef __libcilisp_h_
+#define __libcilisp_h_
+
+/*
+ * libcilisp's public interface: all a program using libcilisp.so needs,
+ * and all the library exports (see libcilisp.c for how it's used).
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <math.h>
+
+
+// run builds libcilisp.so with everything else hidden
+#define CILISP_API __attribute__((visibility("default")))
+
+#define INT_RET_VAL(i) ((RET_VAL) {INT_TYPE, .ival = (i)})
+#define DOUBLE_RET_VAL(d) ((RET_VAL) {DOUBLE_TYPE, .dval = (d)})
+#define NAN_RET_VAL DOUBLE_RET_VAL(NAN)
+#define ZERO_RET_VAL INT_RET_VAL(0)
+
+
+typedef enum num_type {
+    INT_TYPE,
+    DOUBLE_TYPE,
+    UNKNOWN_TYPE, // only in inferTypes' annotations: decided at runtime
+} NUM_TYPE;
+
+
+// Integers get their own 64-bit lane instead of living in a double
+typedef struct {
+    NUM_TYPE type;
+    union {
+        int64_t ival; // INT_TYPE
+        double dval;  // DOUBLE_TYPE
+    };
+} AST_NUMBER;
+
+typedef AST_NUMBER RET_VAL;
+
+
+// Everything one interpreter works with, see struct cilisp_context in cilisp.h
+typedef struct cilisp_context CILISP_CONTEXT;
+// One compiled expression, see cilisp_compile
+typedef struct cilisp_handle CILISP_HANDLE;
+
+CILISP_API CILISP_CONTEXT *cilisp_open(FILE *out);
+CILISP_API void cilisp_close(CILISP_CONTEXT *ctx);
+CILISP_API CILISP_HANDLE *cilisp_compile(CILISP_CONTEXT *ctx, const char *src);
+CILISP_API int cilisp_bind(CILISP_HANDLE *handle, const char *name, RET_VAL value);
+CILISP_API int cilisp_exec(CILISP_HANDLE *handle, RET_VAL *ret);
+CILISP_API void cilisp_free(CILISP_HANDLE *handle);
+
+#endif
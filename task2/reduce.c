@@ -0,0 +1,434 @@
+#include <stddef.h>
+#include "cilisp.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#endif
+
+/*
+ * Reduction kernels for the variadic builtins (add, mult, hypot, max, min).
+ *
+ * These work on DOUBLE_TYPE operands; the builtins handle integers and
+ * mixed lists themselves, with the integer kernels at the end of the file.
+ *
+ * Each kernel has a scalar version and, on x86-64, SSE2 and AVX2 versions
+ * picked at runtime from what the CPU supports. The vector versions read
+ * the RET_VAL array in place: every 16 byte RET_VAL is a type word
+ * followed by its value, so unpacking pairs of loads gathers the values.
+ *
+ * The vector sums and products add in a different order than the scalar
+ * loop, so double results can differ in the last bits. Short operand
+ * lists always use the scalar loop.
+ */
+
+#define SIMD_MIN_OPERANDS 16
+
+typedef struct {
+    double (*sum)(RET_VAL *ops, int count);
+    double (*product)(RET_VAL *ops, int count);
+    double (*sumSquares)(RET_VAL *ops, int count);
+    int (*maxIndex)(RET_VAL *ops, int count);
+    int (*minIndex)(RET_VAL *ops, int count);
+} REDUCE_KERNELS;
+
+_Static_assert(sizeof(RET_VAL) == 16 && offsetof(RET_VAL, dval) == 8,
+               "reduce.c kernels expect RET_VAL to be a type word followed by a double");
+
+
+static double sumScalar(RET_VAL *ops, int count)
+{
+    double sum = 0.0;
+
+    for (int i = 0; i < count; i++) {
+        sum += ops[i].dval;
+    }
+
+    return sum;
+}
+
+static double productScalar(RET_VAL *ops, int count)
+{
+    double product = 1.0;
+
+    for (int i = 0; i < count; i++) {
+        product *= ops[i].dval;
+    }
+
+    return product;
+}
+
+static double sumSquaresScalar(RET_VAL *ops, int count)
+{
+    double sum = 0.0;
+
+    for (int i = 0; i < count; i++) {
+        sum += pow(ops[i].dval, 2);
+    }
+
+    return sum;
+}
+
+// Index of the first greatest operand. NANs are skipped unless ops[0] is one.
+static int maxIndexScalar(RET_VAL *ops, int count)
+{
+    int best = 0;
+
+    for (int i = 1; i < count; i++) {
+        if (ops[best].dval < fmax(ops[best].dval, ops[i].dval)) {
+            best = i;
+        }
+    }
+
+    return best;
+}
+
+// Index of the first smallest operand. NANs are skipped unless ops[0] is one.
+static int minIndexScalar(RET_VAL *ops, int count)
+{
+    int best = 0;
+
+    for (int i = 1; i < count; i++) {
+        if (ops[best].dval > fmin(ops[best].dval, ops[i].dval)) {
+            best = i;
+        }
+    }
+
+    return best;
+}
+
+static const REDUCE_KERNELS scalarKernels = {
+    sumScalar,
+    productScalar,
+    sumSquaresScalar,
+    maxIndexScalar,
+    minIndexScalar
+};
+
+
+#ifdef HAVE_X86_SIMD
+
+static double sumSSE2(RET_VAL *ops, int count)
+{
+    __m128d acc = _mm_setzero_pd();
+    double lanes[2];
+    int i = 0;
+
+    for (; i + 2 <= count; i += 2) {
+        __m128d a = _mm_loadu_pd((double *) &ops[i]);
+        __m128d b = _mm_loadu_pd((double *) &ops[i + 1]);
+        acc = _mm_add_pd(acc, _mm_unpackhi_pd(a, b));
+    }
+
+    _mm_storeu_pd(lanes, acc);
+
+    return lanes[0] + lanes[1] + sumScalar(ops + i, count - i);
+}
+
+static double productSSE2(RET_VAL *ops, int count)
+{
+    __m128d acc = _mm_set1_pd(1.0);
+    double lanes[2];
+    int i = 0;
+
+    for (; i + 2 <= count; i += 2) {
+        __m128d a = _mm_loadu_pd((double *) &ops[i]);
+        __m128d b = _mm_loadu_pd((double *) &ops[i + 1]);
+        acc = _mm_mul_pd(acc, _mm_unpackhi_pd(a, b));
+    }
+
+    _mm_storeu_pd(lanes, acc);
+
+    return lanes[0] * lanes[1] * productScalar(ops + i, count - i);
+}
+
+static double sumSquaresSSE2(RET_VAL *ops, int count)
+{
+    __m128d acc = _mm_setzero_pd();
+    double lanes[2];
+    int i = 0;
+
+    for (; i + 2 <= count; i += 2) {
+        __m128d v = _mm_unpackhi_pd(_mm_loadu_pd((double *) &ops[i]),
+                                    _mm_loadu_pd((double *) &ops[i + 1]));
+        acc = _mm_add_pd(acc, _mm_mul_pd(v, v));
+    }
+
+    _mm_storeu_pd(lanes, acc);
+
+    return lanes[0] + lanes[1] + sumSquaresScalar(ops + i, count - i);
+}
+
+// Picks the lane holding the best value, the earliest index on ties
+static int pickLane(double *values, double *indices, int lanes, bool greatest)
+{
+    int best = 0;
+
+    for (int l = 1; l < lanes; l++) {
+        bool better = greatest ? values[l] > values[best] : values[l] < values[best];
+        if (better || (values[l] == values[best] && indices[l] < indices[best])) {
+            best = l;
+        }
+    }
+
+    return (int) indices[best];
+}
+
+// Every lane starts at ops[0] and only moves on a strictly better value,
+// so each lane ends up on the first best operand it saw. An ordered compare
+// is false for NAN, which skips NANs like fmax/fmin do in the scalar loop.
+static int extremeIndexSSE2(RET_VAL *ops, int count, bool greatest)
+{
+    if (isnan(ops[0].dval)) {
+        return 0;
+    }
+
+    __m128d best = _mm_set1_pd(ops[0].dval);
+    __m128d bestIndex = _mm_setzero_pd();
+    __m128d index = _mm_set_pd(2.0, 1.0);
+    __m128d step = _mm_set1_pd(2.0);
+    double values[2], indices[2];
+    int i = 1;
+
+    for (; i + 2 <= count; i += 2) {
+        __m128d v = _mm_unpackhi_pd(_mm_loadu_pd((double *) &ops[i]),
+                                    _mm_loadu_pd((double *) &ops[i + 1]));
+        __m128d better = greatest ? _mm_cmpgt_pd(v, best) : _mm_cmplt_pd(v, best);
+        best = _mm_or_pd(_mm_and_pd(better, v), _mm_andnot_pd(better, best));
+        bestIndex = _mm_or_pd(_mm_and_pd(better, index), _mm_andnot_pd(better, bestIndex));
+        index = _mm_add_pd(index, step);
+    }
+
+    _mm_storeu_pd(values, best);
+    _mm_storeu_pd(indices, bestIndex);
+    int winner = pickLane(values, indices, 2, greatest);
+
+    for (; i < count; i++) {
+        if (greatest ? ops[i].dval > ops[winner].dval : ops[i].dval < ops[winner].dval) {
+            winner = i;
+        }
+    }
+
+    return winner;
+}
+
+static int maxIndexSSE2(RET_VAL *ops, int count)
+{
+    return extremeIndexSSE2(ops, count, true);
+}
+
+static int minIndexSSE2(RET_VAL *ops, int count)
+{
+    return extremeIndexSSE2(ops, count, false);
+}
+
+static const REDUCE_KERNELS sse2Kernels = {
+    sumSSE2,
+    productSSE2,
+    sumSquaresSSE2,
+    maxIndexSSE2,
+    minIndexSSE2
+};
+
+
+// AVX2 loads two RET_VALs per 256 bit register. Unpacking two loads gives
+// the values of ops[i], ops[i + 2], ops[i + 1], ops[i + 3] in that order.
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static double sumAVX2(RET_VAL *ops, int count)
+{
+    __m256d acc = _mm256_setzero_pd();
+    double lanes[4];
+    int i = 0;
+
+    for (; i + 4 <= count; i += 4) {
+        __m256d a = _mm256_loadu_pd((double *) &ops[i]);
+        __m256d b = _mm256_loadu_pd((double *) &ops[i + 2]);
+        acc = _mm256_add_pd(acc, _mm256_unpackhi_pd(a, b));
+    }
+
+    _mm256_storeu_pd(lanes, acc);
+
+    return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]) + sumScalar(ops + i, count - i);
+}
+
+AVX2 static double productAVX2(RET_VAL *ops, int count)
+{
+    __m256d acc = _mm256_set1_pd(1.0);
+    double lanes[4];
+    int i = 0;
+
+    for (; i + 4 <= count; i += 4) {
+        __m256d a = _mm256_loadu_pd((double *) &ops[i]);
+        __m256d b = _mm256_loadu_pd((double *) &ops[i + 2]);
+        acc = _mm256_mul_pd(acc, _mm256_unpackhi_pd(a, b));
+    }
+
+    _mm256_storeu_pd(lanes, acc);
+
+    return (lanes[0] * lanes[1]) * (lanes[2] * lanes[3]) * productScalar(ops + i, count - i);
+}
+
+AVX2 static double sumSquaresAVX2(RET_VAL *ops, int count)
+{
+    __m256d acc = _mm256_setzero_pd();
+    double lanes[4];
+    int i = 0;
+
+    for (; i + 4 <= count; i += 4) {
+        __m256d v = _mm256_unpackhi_pd(_mm256_loadu_pd((double *) &ops[i]),
+                                       _mm256_loadu_pd((double *) &ops[i + 2]));
+        acc = _mm256_add_pd(acc, _mm256_mul_pd(v, v));
+    }
+
+    _mm256_storeu_pd(lanes, acc);
+
+    return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]) + sumSquaresScalar(ops + i, count - i);
+}
+
+// Same approach as extremeIndexSSE2, four lanes at a time
+AVX2 static int extremeIndexAVX2(RET_VAL *ops, int count, bool greatest)
+{
+    if (isnan(ops[0].dval)) {
+        return 0;
+    }
+
+    __m256d best = _mm256_set1_pd(ops[0].dval);
+    __m256d bestIndex = _mm256_setzero_pd();
+    __m256d index = _mm256_set_pd(4.0, 2.0, 3.0, 1.0);
+    __m256d step = _mm256_set1_pd(4.0);
+    double values[4], indices[4];
+    int i = 1;
+
+    for (; i + 4 <= count; i += 4) {
+        __m256d v = _mm256_unpackhi_pd(_mm256_loadu_pd((double *) &ops[i]),
+                                       _mm256_loadu_pd((double *) &ops[i + 2]));
+        __m256d better = greatest ? _mm256_cmp_pd(v, best, _CMP_GT_OQ) : _mm256_cmp_pd(v, best, _CMP_LT_OQ);
+        best = _mm256_blendv_pd(best, v, better);
+        bestIndex = _mm256_blendv_pd(bestIndex, index, better);
+        index = _mm256_add_pd(index, step);
+    }
+
+    _mm256_storeu_pd(values, best);
+    _mm256_storeu_pd(indices, bestIndex);
+    int winner = pickLane(values, indices, 4, greatest);
+
+    for (; i < count; i++) {
+        if (greatest ? ops[i].dval > ops[winner].dval : ops[i].dval < ops[winner].dval) {
+            winner = i;
+        }
+    }
+
+    return winner;
+}
+
+AVX2 static int maxIndexAVX2(RET_VAL *ops, int count)
+{
+    return extremeIndexAVX2(ops, count, true);
+}
+
+AVX2 static int minIndexAVX2(RET_VAL *ops, int count)
+{
+    return extremeIndexAVX2(ops, count, false);
+}
+
+static const REDUCE_KERNELS avx2Kernels = {
+    sumAVX2,
+    productAVX2,
+    sumSquaresAVX2,
+    maxIndexAVX2,
+    minIndexAVX2
+};
+
+#endif // HAVE_X86_SIMD
+
+
+// Best kernels this CPU can run, chosen on first use. The only state
+// shared by every CILISP_CONTEXT: threads racing to set it all pick the
+// same kernels, so it's only loaded and stored atomically.
+static const REDUCE_KERNELS *reduceKernels;
+
+static const REDUCE_KERNELS *selectReduceKernels(void)
+{
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return &avx2Kernels;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return &sse2Kernels;
+    }
+#endif
+    return &scalarKernels;
+}
+
+static const REDUCE_KERNELS *kernelsFor(int count)
+{
+    if (count < SIMD_MIN_OPERANDS) {
+        return &scalarKernels;
+    }
+    const REDUCE_KERNELS *kernels = __atomic_load_n(&reduceKernels, __ATOMIC_RELAXED);
+    if (kernels == NULL) {
+        kernels = selectReduceKernels();
+        __atomic_store_n(&reduceKernels, kernels, __ATOMIC_RELAXED);
+    }
+
+    return kernels;
+}
+
+double sumOperands(RET_VAL *ops, int count)
+{
+    return kernelsFor(count)->sum(ops, count);
+}
+
+double multiplyOperands(RET_VAL *ops, int count)
+{
+    return kernelsFor(count)->product(ops, count);
+}
+
+double sumSquaredOperands(RET_VAL *ops, int count)
+{
+    return kernelsFor(count)->sumSquares(ops, count);
+}
+
+int maxOperand(RET_VAL *ops, int count)
+{
+    return kernelsFor(count)->maxIndex(ops, count);
+}
+
+int minOperand(RET_VAL *ops, int count)
+{
+    return kernelsFor(count)->minIndex(ops, count);
+}
+
+
+// Integer kernels for INT_TYPE operands. They return false as soon as the
+// result overflows an int64_t, leaving the caller to redo it in doubles.
+
+bool sumIntOperands(RET_VAL *ops, int count, int64_t *sum)
+{
+    int64_t total = 0;
+
+    for (int i = 0; i < count; i++) {
+        if (__builtin_add_overflow(total, ops[i].ival, &total)) {
+            return false;
+        }
+    }
+
+    *sum = total;
+    return true;
+}
+
+bool multiplyIntOperands(RET_VAL *ops, int count, int64_t *product)
+{
+    int64_t total = 1;
+
+    for (int i = 0; i < count; i++) {
+        if (__builtin_mul_overflow(total, ops[i].ival, &total)) {
+            return false;
+        }
+    }
+
+    *product = total;
+    return true;
+}
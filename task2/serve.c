@@ -0,0 +1,387 @@
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "cilisp.h"
+
+/*
+ * --serve PATH: a daemon that evaluates scripts sent to it over the Unix
+ * socket PATH, so a script doesn't pay for starting a process, opening the
+ * log and setting up a scanner. --client PATH [file] sends it one script.
+ *
+ * A request is a script's length, 4 bytes in network order, then the
+ * script. The reply is the length of its output and a status, 0 or 1 if a
+ * parse error ended the script, 4 bytes each in network order, then the
+ * output: what --batch would print for the script, error included. A
+ * connection can send any number of requests, and gets their replies in
+ * order.
+ *
+ * The server runs --jobs threads, one per core by default, all waiting on
+ * one epoll instance. Each has a CILISP_CONTEXT and scanner it keeps for
+ * every request it serves. Connections are registered EPOLLONESHOT, so only
+ * one thread at a time reads one, evaluates what it sent and rearms it.
+ */
+
+#define SERVE_MAX_REQUEST (64 * 1024 * 1024)
+#define SERVE_MAX_FRAME ((int) sizeof(uint32_t) + SERVE_MAX_REQUEST) // with its length
+#define SERVE_SEND_TIMEOUT_MS 10000
+#define SERVE_HEADER_SIZE (2 * sizeof(uint32_t))
+
+typedef struct {
+    int fd;
+    char *data;  // what's been received and not yet evaluated
+    int length;
+    int cap;
+} SERVE_CONNECTION;
+
+typedef struct {
+    CILISP_CONTEXT *options; // whose options the workers' contexts copy
+    int listener;
+    int epoll;
+} SERVER;
+
+// Writes all of data to fd, waiting for the peer to read if it has to.
+// false if the connection failed or the peer stopped reading.
+static bool sendAll(int fd, char *data, size_t length)
+{
+    while (length > 0) {
+        ssize_t sent = send(fd, data, length, MSG_NOSIGNAL);
+
+        if (sent >= 0) {
+            data += sent;
+            length -= sent;
+        }
+        else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            struct pollfd writable = {.fd = fd, .events = POLLOUT};
+            if (poll(&writable, 1, SERVE_SEND_TIMEOUT_MS) <= 0) {
+                return false;
+            }
+        }
+        else if (errno != EINTR) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Evaluates a script as --batch would and sends the reply. false if it
+// couldn't be sent.
+static bool serveScript(CILISP_CONTEXT *ctx, int fd, char *text, size_t length)
+{
+    char *reply = NULL;
+    size_t replyLength = 0;
+    uint32_t header[2] = {0, 0};
+    char *script = malloc(length + 3);
+
+    if (script == NULL || (ctx->out = open_memstream(&reply, &replyLength)) == NULL) {
+        yyerror("Memory allocation failed!");
+    }
+    fwrite(header, 1, SERVE_HEADER_SIZE, ctx->out); // filled in below
+    ctx->ended = false;
+    ctx->error = NULL;
+
+    // Terminated like yymapfile terminates --batch's input
+    memcpy(script, text, length);
+    script[length] = '\n';
+    script[length + 1] = '\0';
+    script[length + 2] = '\0';
+
+    YY_BUFFER_STATE buffer = yy_scan_buffer(script, length + 3, ctx->scanner);
+    yyparse(ctx->scanner, ctx);
+    yy_delete_buffer(buffer, ctx->scanner);
+    free(script);
+
+    clearAst(ctx);
+    if (ctx->error != NULL) {
+        printError(ctx->out, ctx->error);
+    }
+    fclose(ctx->out);
+
+    header[0] = htonl(replyLength - SERVE_HEADER_SIZE);
+    header[1] = htonl(ctx->error != NULL);
+    memcpy(reply, header, SERVE_HEADER_SIZE);
+
+    bool sent = sendAll(fd, reply, replyLength);
+    free(reply);
+
+    return sent;
+}
+
+// Reads what the connection has sent and serves every whole request in it.
+// false once the connection is closed and freed.
+static bool serveConnection(CILISP_CONTEXT *ctx, SERVE_CONNECTION *conn)
+{
+    bool open = true;
+
+    // Reads until the peer pauses, or there's a largest request's worth:
+    // then the first request is whole, so serving it makes room, and a peer
+    // that never pauses can't grow the buffer without end. The rest is
+    // still waiting when the connection is rearmed.
+    while (open && conn->length < SERVE_MAX_FRAME) {
+        conn->data = growArray(conn->data, conn->length, &conn->cap, sizeof(char));
+        int room = conn->cap - conn->length;
+        if (room > SERVE_MAX_FRAME - conn->length) {
+            room = SERVE_MAX_FRAME - conn->length;
+        }
+        ssize_t received = recv(conn->fd, conn->data + conn->length, room, 0);
+
+        if (received > 0) {
+            conn->length += received;
+
+            // Too long a request is refused as soon as its length is in
+            uint32_t scriptLength;
+            if (conn->length >= (int) sizeof(uint32_t)) {
+                memcpy(&scriptLength, conn->data, sizeof(uint32_t));
+                open = ntohl(scriptLength) <= SERVE_MAX_REQUEST;
+            }
+        }
+        else if (received == 0) {
+            open = false;
+        }
+        else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+        }
+        else if (errno != EINTR) {
+            open = false;
+        }
+    }
+
+    // Requests that arrived before the peer closed its end still get replies
+    int served = 0;
+    while (conn->length - served >= (int) sizeof(uint32_t)) {
+        uint32_t scriptLength;
+        memcpy(&scriptLength, conn->data + served, sizeof(uint32_t));
+        scriptLength = ntohl(scriptLength);
+
+        if (scriptLength > SERVE_MAX_REQUEST) {
+            open = false;
+            break;
+        }
+        if (conn->length - served - sizeof(uint32_t) < scriptLength) {
+            break;
+        }
+
+        served += sizeof(uint32_t);
+        if (!serveScript(ctx, conn->fd, conn->data + served, scriptLength)) {
+            open = false;
+            break;
+        }
+        served += scriptLength;
+    }
+    memmove(conn->data, conn->data + served, conn->length - served);
+    conn->length -= served;
+
+    if (!open) {
+        close(conn->fd);
+        free(conn->data);
+        free(conn);
+    }
+
+    return open;
+}
+
+// Accepts every connection that's waiting, registering each with the epoll
+static void acceptConnections(SERVER *server)
+{
+    while (true) {
+        int fd = accept(server->listener, NULL, NULL);
+
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                warning(server->options, "--serve couldn't accept a connection: %s", strerror(errno));
+            }
+            return;
+        }
+
+        SERVE_CONNECTION *conn = calloc(1, sizeof(SERVE_CONNECTION));
+        if (conn == NULL) {
+            yyerror("Memory allocation failed!");
+        }
+        conn->fd = fd;
+
+        struct epoll_event event = {.events = EPOLLIN | EPOLLONESHOT, .data.ptr = conn};
+        if (fcntl(fd, F_SETFL, O_NONBLOCK) != 0 || fcntl(fd, F_SETFD, FD_CLOEXEC) != 0 ||
+            epoll_ctl(server->epoll, EPOLL_CTL_ADD, fd, &event) != 0) {
+            close(fd);
+            free(conn);
+        }
+    }
+}
+
+static void *serveWorker(void *arg)
+{
+    SERVER *server = arg;
+    CILISP_CONTEXT *ctx = createContext(NULL);
+
+    ctx->vm = server->options->vm;
+    ctx->maxDepth = server->options->maxDepth;
+    ctx->readTarget = server->options->readTarget;
+    ctx->batchMode = true;
+    ctx->keepRunning = true;
+    if (yylex_init_extra(ctx, &ctx->scanner) != 0) {
+        yyerror("Memory allocation failed!");
+    }
+
+    while (true) {
+        struct epoll_event event;
+
+        if (epoll_wait(server->epoll, &event, 1, -1) != 1) {
+            continue;
+        }
+
+        // The listener is the one registration without a connection
+        SERVE_CONNECTION *conn = event.data.ptr;
+        int fd = server->listener;
+
+        if (conn == NULL) {
+            acceptConnections(server);
+        }
+        else {
+            // EPOLLONESHOT: until this thread rearms conn, no other is woken
+            // for it, and epoll_ctl orders what this one did before the
+            // next one's wakeup
+            if (!serveConnection(ctx, conn)) {
+                continue;
+            }
+            fd = conn->fd;
+        }
+
+        event.events = EPOLLIN | EPOLLONESHOT;
+        epoll_ctl(server->epoll, EPOLL_CTL_MOD, fd, &event);
+    }
+
+    return NULL;
+}
+
+// Serves requests on the socket at path, on ctx->jobs threads, until killed
+void runServer(CILISP_CONTEXT *ctx, char *path)
+{
+    SERVER server = {.options = ctx};
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    int threads = ctx->jobs > 0 ? ctx->jobs : (int) sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        yyerror("--serve socket path too long: %s", path);
+    }
+    strcpy(address.sun_path, path);
+
+    // A socket file left by an earlier server would make bind fail. Any
+    // other file at path isn't ours to remove.
+    struct stat existing;
+    if (lstat(path, &existing) == 0) {
+        if (!S_ISSOCK(existing.st_mode)) {
+            yyerror("--serve couldn't listen on %s: %s", path, "not a socket");
+        }
+        unlink(path);
+    }
+    server.listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (server.listener < 0 ||
+        bind(server.listener, (struct sockaddr *) &address, sizeof(address)) != 0 ||
+        listen(server.listener, SOMAXCONN) != 0) {
+        yyerror("--serve couldn't listen on %s: %s", path, strerror(errno));
+    }
+
+    struct epoll_event event = {.events = EPOLLIN | EPOLLONESHOT, .data.ptr = NULL};
+    if ((server.epoll = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+        epoll_ctl(server.epoll, EPOLL_CTL_ADD, server.listener, &event) != 0) {
+        yyerror("--serve couldn't start: %s", strerror(errno));
+    }
+
+    if (threads < 1) {
+        threads = 1;
+    }
+    for (int i = 1; i < threads; i++) {
+        pthread_t worker;
+        if (pthread_create(&worker, NULL, serveWorker, &server) != 0) {
+            yyerror("Couldn't start --serve thread %d", i + 1);
+        }
+        pthread_detach(worker);
+    }
+
+    fprintf(ctx->out, "Serving on %s with %d thread%s\n", path, threads, threads == 1 ? "" : "s");
+    fflush(ctx->out);
+
+    serveWorker(&server);
+}
+
+// Reads exactly length bytes from fd. false if the connection ended first.
+static bool receiveAll(int fd, char *data, size_t length)
+{
+    while (length > 0) {
+        ssize_t received = recv(fd, data, length, 0);
+
+        if (received > 0) {
+            data += received;
+            length -= received;
+        }
+        else if (received == 0 || errno != EINTR) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Sends the script in to the server at path and prints what it printed.
+// The exit status cilisp --batch would have had running the script.
+int runClient(char *path, FILE *in)
+{
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    char *request = NULL;
+    int length = sizeof(uint32_t);
+    int cap = 0;
+
+    // The request's length goes in front once the script is read
+    while (true) {
+        request = growArray(request, length, &cap, sizeof(char));
+        size_t got = fread(request + length, 1, cap - length, in);
+        if (got == 0) {
+            break;
+        }
+        length += got;
+    }
+
+    uint32_t header[2] = {htonl(length - sizeof(uint32_t)), 0};
+    memcpy(request, header, sizeof(uint32_t));
+
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        yyerror("--client socket path too long: %s", path);
+    }
+    strcpy(address.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *) &address, sizeof(address)) != 0) {
+        yyerror("--client couldn't connect to %s: %s", path, strerror(errno));
+    }
+
+    if (!sendAll(fd, request, length) || !receiveAll(fd, (char *) header, SERVE_HEADER_SIZE)) {
+        yyerror("--client lost the connection to %s", path);
+    }
+    free(request);
+
+    size_t replyLength = ntohl(header[0]);
+    char *reply = malloc(replyLength + 1);
+    if (reply == NULL) {
+        yyerror("Memory allocation failed!");
+    }
+    if (!receiveAll(fd, reply, replyLength)) {
+        yyerror("--client lost the connection to %s", path);
+    }
+    close(fd);
+
+    fwrite(reply, 1, replyLength, stdout);
+    fflush(stdout);
+    free(reply);
+
+    return ntohl(header[1]) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,105 @@
+/*
+ * Checks that --max-depth stops the bytecode VM where it stops the tree
+ * walker, for chains of let values that load each other:
+ *     ((let (a0 1) (a1 (add a0 1)) ... (aN (add aN-1 1))) aN)
+ * Each link nests the next binding's code inside the one loading it, so
+ * the VM has to count the frames the walker would have.
+ *
+ * From task2/ (builtins.c is generated by the awk step of run):
+ *     awk -f genbuiltins.awk builtins.txt
+ *     gcc -O2 -I. test/depth_test.c -o depth_test -lm && ./depth_test
+ */
+#include "cilisp.c"
+#include "builtins.c"
+#include "arena.c"
+#include "reduce.c"
+#include "vm.c"
+
+static int failures;
+
+// The chain of links let values, resolved and typed like a parsed expression
+static NODE_INDEX buildChain(CILISP_CONTEXT *ctx, int links)
+{
+    SYMBOL_TABLE_NODE *list = NULL;
+    char name[32];
+    char *previous = NULL;
+
+    for (int i = 0; i < links; i++) {
+        snprintf(name, sizeof(name), "a%d", i);
+        char *id = internSymbol(ctx, name);
+        NODE_INDEX value = createNumberNode(ctx, INT_RET_VAL(1));
+
+        if (previous != NULL) {
+            int operands = startExpressionList(ctx);
+            addExpressionToList(ctx, createSymbolNode(ctx, previous), operands);
+            addExpressionToList(ctx, createNumberNode(ctx, INT_RET_VAL(1)), operands);
+            value = createFunctionNode(ctx, ADD_FUNC, operands);
+        }
+        list = addSymbolToList(ctx, createSymbolTableNode(ctx, id, value), list);
+        previous = id;
+    }
+
+    NODE_INDEX root = createScopeNode(ctx, list, createSymbolNode(ctx, previous));
+    resolveSymbols(ctx, root);
+    inferTypes(ctx, root);
+
+    return root;
+}
+
+// The chain's value with the tree walker, or with the VM
+static RET_VAL evalChain(CILISP_CONTEXT *ctx, NODE_INDEX root, bool treeWalk)
+{
+    ctx->vm = !treeWalk;
+
+    return eval(ctx, root);
+}
+
+static void expect(bool ok, const char *what, int links, int maxDepth)
+{
+    if (!ok) {
+        printf("FAIL: %s (%d links, --max-depth=%d)\n", what, links, maxDepth);
+        failures++;
+    }
+}
+
+int main(void)
+{
+    char *output;
+    size_t outputLength;
+    CILISP_CONTEXT *ctx = createContext(open_memstream(&output, &outputLength));
+
+    // A chain much deeper than the limit: both give up, with the warning
+    ctx->maxDepth = 1000;
+    NODE_INDEX root = buildChain(ctx, 20000);
+    RET_VAL walked = evalChain(ctx, root, true);
+    RET_VAL run = evalChain(ctx, root, false);
+    fflush(ctx->out);
+    expect(isnan(toDouble(walked)), "tree walker went past the limit", 20000, 1000);
+    expect(isnan(toDouble(run)), "VM went past the limit", 20000, 1000);
+    expect(strstr(output, "nested deeper than 1000 levels") != NULL, "no depth warning", 20000, 1000);
+
+    // ... and under a limit it fits, both evaluate it
+    ctx->maxDepth = DEFAULT_MAX_DEPTH;
+    walked = evalChain(ctx, root, true);
+    run = evalChain(ctx, root, false);
+    expect(walked.type == INT_TYPE && walked.ival == 20000, "tree walker value", 20000, DEFAULT_MAX_DEPTH);
+    expect(run.type == INT_TYPE && run.ival == 20000, "VM value", 20000, DEFAULT_MAX_DEPTH);
+    clearAst(ctx);
+
+    // Around the limit a short chain needs, they give up at the same one
+    root = buildChain(ctx, 100);
+    for (int maxDepth = 1; maxDepth <= 400; maxDepth++) {
+        ctx->maxDepth = maxDepth;
+        walked = evalChain(ctx, root, true);
+        run = evalChain(ctx, root, false);
+        expect(isnan(toDouble(walked)) == isnan(toDouble(run)), "evaluators disagree", 100, maxDepth);
+    }
+    clearAst(ctx);
+
+    fclose(ctx->out);
+    free(output);
+    freeContext(ctx);
+
+    printf("%s\n", failures == 0 ? "ok" : "FAILED");
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,69 @@
+#!/bin/sh
+# Round trips scripts through a --serve daemon with --client, several
+# clients at once, and checks each reply and exit status against --batch.
+# Scripts that read from the read target are left out, since a client's
+# script is its stdin.
+#
+# From task2/, after run:
+#     sh test/serve_test.sh
+
+dir=$(mktemp -d) || exit 1
+sock="$dir/cilisp.sock"
+failures=0
+
+./cilisp --serve "$sock" --jobs 4 > "$dir/server.log" 2>&1 &
+server=$!
+trap 'kill $server 2> /dev/null; rm -rf "$dir"' EXIT
+
+tries=0
+while [ ! -S "$sock" ]; do
+    tries=$((tries + 1))
+    if [ $tries -gt 50 ] || ! kill -0 $server 2> /dev/null; then
+        echo "FAIL: the server didn't start:"
+        cat "$dir/server.log"
+        echo "FAILED"
+        exit 1
+    fi
+    sleep 0.1
+done
+
+# A script with a parse error, one that quits halfway, and one too big to
+# arrive in one read, so the server has to wait for the rest of it
+printf '(add 1 2)\n(mult 2\n' > "$dir/error.cilisp"
+printf '(add 1 2)\nquit\n(add 3 4)\n' > "$dir/quit.cilisp"
+awk 'BEGIN { for (i = 0; i < 50000; i++) printf "(add %d (mult %d 2) 1.5)\n", i, i }' > "$dir/big.cilisp"
+
+n=0
+clients=
+for script in INPUTS/*.cilisp INPUTS/*/*.cilisp "$dir/error.cilisp" "$dir/quit.cilisp" "$dir/big.cilisp"; do
+    if grep -q read "$script"; then
+        continue
+    fi
+    n=$((n + 1))
+    echo "$script" > "$dir/$n.name"
+    ./cilisp --batch "$script" < /dev/null > "$dir/$n.expected" 2>&1
+    echo $? >> "$dir/$n.expected"
+    (./cilisp --client "$sock" < "$script" > "$dir/$n.got" 2>&1; echo $? >> "$dir/$n.got") &
+    clients="$clients $!"
+done
+# A request the server never answers fails its comparison, not the test run
+(sleep 20; kill $clients 2> /dev/null) &
+watchdog=$!
+wait $clients
+kill $watchdog 2> /dev/null
+
+i=1
+while [ $i -le $n ]; do
+    if ! cmp -s "$dir/$i.expected" "$dir/$i.got"; then
+        echo "FAIL: $(cat "$dir/$i.name") answered differently than --batch"
+        failures=$((failures + 1))
+    fi
+    i=$((i + 1))
+done
+
+if [ $failures -eq 0 ]; then
+    echo ok
+else
+    echo FAILED
+fi
+[ $failures -eq 0 ]
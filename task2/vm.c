@@ -0,0 +1,415 @@
+#include "cilisp.h"
+
+/*
+ * Bytecode compiler and VM.
+ *
+ * compileChunk lowers one top-level AST into a flat array of INSTRUCTIONs:
+ * operands are pushed left to right and a CALL_OP applies the builtin to
+ * the top of the stack. Symbols come resolved by resolveSymbols, so the VM
+ * never walks symbol tables. Each let definition a symbol refers to gets
+ * a BINDING whose value code is compiled after the main expression and
+ * only run the first time the binding is loaded.
+ *
+ * Compiling costs more than walking the AST once, so the VM is for
+ * expressions that run many times: libcilisp's handles. eval only uses it
+ * with --vm.
+ *
+ * --max-depth counts what the tree walker would have on its frame stack,
+ * so the two evaluators give up on the same expressions. Within a block
+ * that's the compiler's own frames; runChunk adds up the blocks a chain of
+ * bindings being loaded nests.
+ *
+ * Compiling and running never modify the AST, and runChunk keeps every
+ * value it computes in the chunk, so a chunk can be run any number of times.
+ *
+ * Each CALL_OP carries the kernel nodeKernel picked for its call, so running
+ * it is one indirect call with no lookup. With GCC or clang, runChunk jumps
+ * from each instruction straight to the next one's handler (computed goto)
+ * instead of going back through a switch; define NO_COMPUTED_GOTO to get
+ * the switch everywhere.
+ */
+
+#if defined(__GNUC__) && !defined(NO_COMPUTED_GOTO)
+#define USE_COMPUTED_GOTO
+#endif
+
+// Compiler state for the block (main expression or binding value) being emitted
+typedef struct {
+    CILISP_CONTEXT *ctx;
+    CHUNK *chunk;
+    int depth;     // values on the stack at the current instruction
+    int maxDepth;  // most values this block ever has on the stack
+    int maxFrames; // most nodes this block has the compiler (or tree walker) in at once
+} COMPILER;
+
+static INSTRUCTION *emit(COMPILER *compiler, OP_CODE op, int a, int b, int stackEffect)
+{
+    CHUNK *chunk = compiler->chunk;
+
+    chunk->code = growArray(chunk->code, chunk->codeCount, &chunk->codeCap, sizeof(INSTRUCTION));
+    chunk->code[chunk->codeCount] = (INSTRUCTION) {op, a, b, NULL};
+
+    compiler->depth += stackEffect;
+    if (compiler->depth > compiler->maxDepth) {
+        compiler->maxDepth = compiler->depth;
+    }
+
+    return &chunk->code[chunk->codeCount++];
+}
+
+static int addConstant(CHUNK *chunk, RET_VAL value)
+{
+    chunk->constants = growArray(chunk->constants, chunk->constantCount, &chunk->constantCap, sizeof(RET_VAL));
+    chunk->constants[chunk->constantCount] = value;
+
+    return chunk->constantCount++;
+}
+
+// Index of sym's binding, added (to be compiled later) the first time sym
+// is referenced. sym->binding remembers it until compileChunk is done.
+static int addBinding(CHUNK *chunk, SYMBOL_TABLE_NODE *sym)
+{
+    if (sym->binding > 0) {
+        return sym->binding - 1;
+    }
+
+    chunk->bindings = growArray(chunk->bindings, chunk->bindingCount, &chunk->bindingCap, sizeof(BINDING));
+    chunk->bindings[chunk->bindingCount] = (BINDING) {sym, sym->id, 0, 0, UNEVALUATED, NAN_RET_VAL};
+    sym->binding = chunk->bindingCount + 1;
+
+    return chunk->bindingCount++;
+}
+
+static size_t hashPointer(const void *pointer)
+{
+    return ((uintptr_t) pointer >> 4) * 11400714819323198485UL >> 16; // Fibonacci hashing
+}
+
+// Doubles ctx->freeVariableSlots, keeping this chunk's entries
+static void growFreeVariableSlots(CILISP_CONTEXT *ctx, CHUNK *chunk)
+{
+    int cap = ctx->freeVariableSlotCap ? 2 * ctx->freeVariableSlotCap : 64;
+    FREE_VARIABLE_SLOT *slots = calloc(cap, sizeof(FREE_VARIABLE_SLOT));
+
+    if (slots == NULL) {
+        yyerror("Memory allocation failed!");
+    }
+
+    for (int i = 0; i < chunk->freeVariableCount; i++) {
+        size_t slot = hashPointer(chunk->freeVariables[i].name) & (cap - 1);
+        while (slots[slot].stamp == ctx->compileStamp) {
+            slot = (slot + 1) & (cap - 1);
+        }
+        slots[slot] = (FREE_VARIABLE_SLOT) {chunk->freeVariables[i].name, chunk->freeVariables[i].constant, ctx->compileStamp};
+    }
+
+    free(ctx->freeVariableSlots);
+    ctx->freeVariableSlots = slots;
+    ctx->freeVariableSlotCap = cap;
+}
+
+// Index of the constant holding free variable name, added the first time
+// name is referenced. ctx->freeVariableSlots finds it again: open
+// addressing, kept at most half full, where only entries stamped with this
+// chunk's compileStamp count, so a new chunk starts out with it empty.
+static int addFreeVariable(COMPILER *compiler, char *name)
+{
+    CILISP_CONTEXT *ctx = compiler->ctx;
+    CHUNK *chunk = compiler->chunk;
+
+    if (2 * (chunk->freeVariableCount + 1) > ctx->freeVariableSlotCap) {
+        growFreeVariableSlots(ctx, chunk);
+    }
+
+    int mask = ctx->freeVariableSlotCap - 1;
+    size_t slot = hashPointer(name) & mask;
+    while (ctx->freeVariableSlots[slot].stamp == ctx->compileStamp) {
+        if (ctx->freeVariableSlots[slot].name == name) {
+            return ctx->freeVariableSlots[slot].constant;
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    chunk->freeVariables = growArray(chunk->freeVariables, chunk->freeVariableCount, &chunk->freeVariableCap, sizeof(FREE_VARIABLE));
+    chunk->freeVariables[chunk->freeVariableCount] = (FREE_VARIABLE) {name, addConstant(chunk, NAN_RET_VAL)};
+    ctx->freeVariableSlots[slot] = (FREE_VARIABLE_SLOT) {name, chunk->freeVariables[chunk->freeVariableCount].constant, ctx->compileStamp};
+
+    return chunk->freeVariables[chunk->freeVariableCount++].constant;
+}
+
+// ctx->compileFrames holds the nodes compileNode is in the middle of,
+// innermost last; the same nodes the tree walker's frames would hold
+static bool pushCompileFrame(COMPILER *compiler, NODE_INDEX node)
+{
+    CILISP_CONTEXT *ctx = compiler->ctx;
+
+    if (ctx->compileFrameCount >= ctx->maxDepth) {
+        return false;
+    }
+
+    ctx->compileFrames = growArray(ctx->compileFrames, ctx->compileFrameCount, &ctx->compileFrameCap, sizeof(COMPILE_FRAME));
+    ctx->compileFrames[ctx->compileFrameCount++] = (COMPILE_FRAME) {node, 0};
+    if (ctx->compileFrameCount > compiler->maxFrames) {
+        compiler->maxFrames = ctx->compileFrameCount;
+    }
+
+    return true;
+}
+
+// Emits root's code operands first, keeping its own stack of the nodes
+// being compiled rather than recursing. false if root nests deeper than
+// ctx->maxDepth.
+static bool compileNode(COMPILER *compiler, NODE_INDEX root)
+{
+    CILISP_CONTEXT *ctx = compiler->ctx;
+    CHUNK *chunk = compiler->chunk;
+    SYMBOL_TABLE_NODE *sym;
+    int count;
+
+    ctx->compileFrameCount = 0;
+    if (!pushCompileFrame(compiler, root)) {
+        return false;
+    }
+
+    while (ctx->compileFrameCount > 0) {
+        COMPILE_FRAME *frame = &ctx->compileFrames[ctx->compileFrameCount - 1];
+        AST_NODE *node = &ctx->tree.nodes[frame->node];
+
+        switch (node->type) {
+            case NUM_NODE_TYPE:
+                emit(compiler, NUM_OP, addConstant(chunk, evalNumNode(node)), 0, 1);
+                ctx->compileFrameCount--;
+                break;
+            case FUNC_NODE_TYPE:
+                count = node->data.function.count;
+                if (frame->next < count) {
+                    if (!pushCompileFrame(compiler, ctx->tree.operands[node->data.function.first + frame->next++])) {
+                        return false;
+                    }
+                    break;
+                }
+                emit(compiler, CALL_OP, node->subtype, count, 1 - count)->kernel = nodeKernel(node);
+                ctx->compileFrameCount--;
+                break;
+            case SYM_NODE_TYPE:
+                if ((sym = ctx->tree.symbols[node->data.symbol.index].definition) == NULL) {
+                    // Undefined (already reported by resolveSymbols) or, for
+                    // cilisp_compile, free
+                    emit(compiler, NUM_OP, addFreeVariable(compiler, ctx->tree.symbols[node->data.symbol.index].id), 0, 1);
+                }
+                else {
+                    emit(compiler, LOAD_OP, addBinding(chunk, sym), ctx->compileFrameCount, 1);
+                }
+                ctx->compileFrameCount--;
+                break;
+            case SCOPE_NODE_TYPE:
+                // The let definitions only matter through the symbols that use them
+                if (frame->next++ == 0) {
+                    if (!pushCompileFrame(compiler, node->data.scope.child)) {
+                        return false;
+                    }
+                    break;
+                }
+                ctx->compileFrameCount--;
+                break;
+        }
+    }
+
+    return true;
+}
+
+// Compiles node followed by a RETURN_OP and returns the index of its first
+// instruction, -1 if node is too deep. *frames is set to the block's
+// deepest nesting.
+static int compileBlock(CILISP_CONTEXT *ctx, CHUNK *chunk, NODE_INDEX node, int *frames)
+{
+    COMPILER compiler = {ctx, chunk, 0, 0, 0};
+    int entry = chunk->codeCount;
+
+    if (!compileNode(&compiler, node)) {
+        return -1;
+    }
+    emit(&compiler, RETURN_OP, 0, 0, 0);
+    *frames = compiler.maxFrames;
+
+    // A binding's code runs on top of whatever is already on the stack,
+    // so reserving every block's maximum is always enough
+    chunk->stackMax += compiler.maxDepth;
+
+    return entry;
+}
+
+// NULL, with a warning, if the expression nests deeper than ctx->maxDepth
+// The AST can be compiled again, into another chunk
+static void forgetBindings(CHUNK *chunk)
+{
+    for (int i = 0; i < chunk->bindingCount; i++) {
+        chunk->bindings[i].sym->binding = 0;
+    }
+}
+
+CHUNK *compileChunk(CILISP_CONTEXT *ctx, NODE_INDEX root)
+{
+    ERROR_TRAP trap;
+    ERROR_TRAP *outer = errorTrap;
+    CHUNK *volatile chunk = NULL;
+    int frames;
+
+    // Running out of memory part way through frees the chunk before the
+    // error goes on to the caller's trap (or ends the process)
+    if (setjmp(trap.jump) != 0) {
+        errorTrap = outer;
+        if (chunk != NULL) {
+            forgetBindings(chunk);
+            freeChunk(chunk);
+        }
+        yyerror("%s", trap.message);
+    }
+    errorTrap = &trap;
+
+    if ((chunk = calloc(sizeof(CHUNK), 1)) == NULL) {
+        yyerror("Memory allocation failed!");
+    }
+
+    // A new stamp empties ctx->freeVariableSlots; 0 is what calloc leaves
+    // in the ones never used, so it's skipped, and when the stamps wrap
+    // around the old entries are really cleared
+    if (++ctx->compileStamp == 0) {
+        memset(ctx->freeVariableSlots, 0, sizeof(FREE_VARIABLE_SLOT) * ctx->freeVariableSlotCap);
+        ctx->compileStamp = 1;
+    }
+
+    bool tooDeep = compileBlock(ctx, chunk, root, &frames) < 0;
+
+    // Compiling a binding's value can reference more bindings
+    for (int i = 0; i < chunk->bindingCount && !tooDeep; i++) {
+        // compileBlock can grow (and move) chunk->bindings
+        int entry = compileBlock(ctx, chunk, chunk->bindings[i].sym->value, &frames);
+        chunk->bindings[i].entry = entry;
+        chunk->bindings[i].frames = frames;
+        tooDeep = entry < 0;
+    }
+
+    if (!tooDeep) {
+        chunk->stack = malloc(sizeof(RET_VAL) * chunk->stackMax);
+        chunk->frames = malloc(sizeof(FRAME) * (chunk->bindingCount + 1));
+        if (chunk->stack == NULL || chunk->frames == NULL) {
+            yyerror("Memory allocation failed!");
+        }
+    }
+
+    errorTrap = outer;
+    forgetBindings(chunk);
+
+    if (tooDeep) {
+        fprintf(ctx->out, "WARNING: Expression nested deeper than %d levels! NAN returned!\n", ctx->maxDepth);
+        freeChunk(chunk);
+        return NULL;
+    }
+
+    return chunk;
+}
+
+#ifdef USE_COMPUTED_GOTO
+#define DISPATCH() goto *handlers[(ins = code[pc++]).op]
+#define CASE(op) handle_##op
+#else
+#define DISPATCH() continue
+#define CASE(op) case op
+#endif
+
+RET_VAL runChunk(CILISP_CONTEXT *ctx, CHUNK *chunk)
+{
+    INSTRUCTION *code = chunk->code;
+    RET_VAL *sp = chunk->stack;
+    int frameCount = 0;
+    int walkerFrames = 0; // below the running block, see FRAME
+    int pc = 0;
+    BINDING *binding;
+    INSTRUCTION ins;
+
+#ifdef USE_COMPUTED_GOTO
+    static void *const handlers[] = {
+        [NUM_OP] = &&handle_NUM_OP,
+        [LOAD_OP] = &&handle_LOAD_OP,
+        [CALL_OP] = &&handle_CALL_OP,
+        [RETURN_OP] = &&handle_RETURN_OP
+    };
+#endif
+
+    for (int i = 0; i < chunk->bindingCount; i++) {
+        chunk->bindings[i].state = UNEVALUATED;
+    }
+
+#ifdef USE_COMPUTED_GOTO
+    DISPATCH();
+#else
+    while (true) {
+        ins = code[pc++];
+
+        switch (ins.op) {
+#endif
+            CASE(NUM_OP):
+                *sp++ = chunk->constants[ins.a];
+                DISPATCH();
+            CASE(LOAD_OP):
+                binding = &chunk->bindings[ins.a];
+                if (binding->state == EVALUATED) {
+                    *sp++ = binding->value;
+                }
+                else if (binding->state == EVALUATING) {
+                    fprintf(ctx->out, "WARNING: Circular definition of \"%s\" evaluated! NAN returned!\n", binding->id);
+                    *sp++ = NAN_RET_VAL;
+                }
+                else if (walkerFrames + ins.b + binding->frames > ctx->maxDepth) {
+                    // The tree walker would run out of frames in the binding's code
+                    fprintf(ctx->out, "WARNING: Expression nested deeper than %d levels! NAN returned!\n", ctx->maxDepth);
+                    return NAN_RET_VAL;
+                }
+                else {
+                    // Run the binding's code; its RETURN_OP leaves the value on the stack
+                    binding->state = EVALUATING;
+                    chunk->frames[frameCount++] = (FRAME) {pc, ins.a, walkerFrames};
+                    walkerFrames += ins.b;
+                    pc = binding->entry;
+                }
+                DISPATCH();
+            CASE(CALL_OP):
+                sp -= ins.b;
+                *sp = ins.kernel(ctx, sp, ins.b);
+                sp++;
+                DISPATCH();
+            CASE(RETURN_OP):
+                if (frameCount == 0) {
+                    return sp[-1];
+                }
+                frameCount--;
+                binding = &chunk->bindings[chunk->frames[frameCount].binding];
+                binding->value = sp[-1];
+                binding->state = EVALUATED;
+                walkerFrames = chunk->frames[frameCount].walkerFrames;
+                pc = chunk->frames[frameCount].returnPc;
+                DISPATCH();
+#ifndef USE_COMPUTED_GOTO
+        }
+    }
+#endif
+}
+
+#undef DISPATCH
+#undef CASE
+
+void freeChunk(CHUNK *chunk)
+{
+    if (!chunk) {
+        return;
+    }
+
+    free(chunk->code);
+    free(chunk->constants);
+    free(chunk->bindings);
+    free(chunk->freeVariables);
+    free(chunk->stack);
+    free(chunk->frames);
+    free(chunk);
+}
@@ -1,5 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "cilisp.h"
 
 #define INITIAL_BUFFER_SIZE 128
@@ -73,7 +75,7 @@ size_t yyreadline(char **lineptr, size_t *n, FILE *stream, size_t n_terminate)
     return (p - bufptr);
 }
 
-void yyprintline(char *line, size_t len, size_t n_extra_terminates)
+void yyprintline(FILE *out, char *line, size_t len, size_t n_extra_terminates)
 {
     size_t lastIndex = len - 1 - n_extra_terminates;
     char lastChar = line[lastIndex];
@@ -82,12 +84,63 @@ void yyprintline(char *line, size_t len, size_t n_extra_terminates)
     if (lastChar == EOF)
     {
         line[lastIndex] = '\0';
-        if (lastIndex == 0) printf("%sEOF\n", line);
-        else printf("%s\n", line);
+        if (lastIndex == 0) fprintf(out, "%sEOF\n", line);
+        else fprintf(out, "%s\n", line);
         line[lastIndex] = EOF;
     }
     else
     {
-        printf("%s", line);
+        fprintf(out, "%s", line);
+    }
+}
+
+// Maps the whole of stream into memory so flex can scan it as one buffer.
+// The mapping is followed by a '\n' (so the last line is terminated even
+// if the file isn't) and n_terminate '\0's for yy_scan_buffer.
+// Returns NULL if stream isn't a regular file (a pipe, a terminal...).
+char *yymapfile(FILE *stream, size_t *n, size_t n_terminate)
+{
+    struct stat st;
+    char *bufptr;
+    size_t size;
+
+    if (stream == NULL || n == NULL)
+    {
+        return NULL;
+    }
+    if (fstat(fileno(stream), &st) != 0 || !S_ISREG(st.st_mode))
+    {
+        return NULL;
+    }
+    size = (size_t) st.st_size;
+
+    // Reserve zeroed memory for the file plus terminators, then map the
+    // file over the front of it. Bytes past the end of the file are zero
+    // whether they land in the file's last page or in the reserved pages.
+    bufptr = mmap(NULL, size + 1 + n_terminate, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (bufptr == MAP_FAILED)
+    {
+        return NULL;
+    }
+    if (size > 0 &&
+        mmap(bufptr, size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_FIXED, fileno(stream), 0) == MAP_FAILED)
+    {
+        munmap(bufptr, size + 1 + n_terminate);
+        return NULL;
+    }
+
+    bufptr[size] = '\n';
+    *n = size + 1 + n_terminate;
+
+    return bufptr;
+}
+
+void yyunmapfile(char *buf, size_t len)
+{
+    if (buf != NULL)
+    {
+        munmap(buf, len);
     }
 }